@@ -85,23 +85,25 @@ static inline void* arena_alloc_aligned(arena_t* arena, const u64 size, const u6
     assert(is_power_of_two(alignment));
 
     const u64 aligned_size = align_size(size, alignment);
+    const u64 position = align_size(arena->position, alignment); // start is page-aligned
 
-    if (arena->capacity - arena->position < aligned_size) {
+    if (position > arena->capacity || arena->capacity - position < aligned_size) {
         return NULL;
     }
 
-    void* ptr = (void*)(arena->start + arena->position);
-    arena->position += aligned_size;
+    void* ptr = (void*)(arena->start + position);
+    arena->position = position + aligned_size;
 
     ASAN_UNPOISON_MEMORY_REGION((void*)ptr, aligned_size);
 
     return ptr;
 }
 
+// Only the used part is poisoned, so clearing a mostly empty arena stays cheap
 static inline void arena_clear(arena_t* arena) {
     assert(arena_valid(arena));
 
-    ASAN_POISON_MEMORY_REGION((void*)arena->start, arena->capacity);
+    ASAN_POISON_MEMORY_REGION((void*)arena->start, arena->position);
 
     arena->position = 0;
 }
@@ -111,7 +113,7 @@ static inline void arena_release(arena_t* arena) {
 
     madvise((void*)arena->start, arena->capacity, MADV_DONTNEED);
 
-    ASAN_POISON_MEMORY_REGION((void*)arena->start, arena->capacity);
+    ASAN_POISON_MEMORY_REGION((void*)arena->start, arena->position);
 
     arena->position = 0;
 }
@@ -119,7 +121,8 @@ static inline void arena_release(arena_t* arena) {
 bool arena_delete(arena_t* arena) {
     assert(arena_valid(arena));
 
-    ASAN_POISON_MEMORY_REGION((void*)arena->start, arena->capacity);
+    // The address range may be handed out again by a later mmap(), which must not inherit the poison
+    ASAN_UNPOISON_MEMORY_REGION((void*)arena->start, arena->capacity);
 
     const bool result = munmap((void*)arena->start, arena->capacity) == 0;
 
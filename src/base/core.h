@@ -70,9 +70,11 @@ typedef double f64;
 #define TB(n) (((u64)(n)) << 40)
 
 #define DEFAULT_ALIGNMENT 8
+#define CACHE_LINE_SIZE 64
 
 static inline bool is_power_of_two(size_t x);
 static inline size_t align_size(const size_t size, const size_t alignment);
+static inline u64 hash_inode(u64 dev, u64 ino);
 
 #ifdef CORE_IMPLEMENTATION
 
@@ -85,6 +87,14 @@ static inline size_t align_size(const size_t size, const size_t alignment) {
     return (size + (alignment - 1)) & ~(alignment - 1);
 }
 
+// splitmix64 finalizer over ino mixed with dev, for hash tables keyed by (dev, ino)
+static inline u64 hash_inode(const u64 dev, const u64 ino) {
+    u64 x = ino ^ (dev * 0x9E3779B97F4A7C15ull);
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
 
 #if defined (__GNUC__) || defined(__clang__)
 #define int3() __asm__ volatile("int3")
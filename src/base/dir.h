@@ -0,0 +1,108 @@
+#pragma once
+
+#ifdef DIR_IMPLEMENTATION
+#ifndef STRING_IMPLEMENTATION
+#define STRING_IMPLEMENTATION
+#endif
+#endif
+#include "string.h"
+
+// Directory reader on top of raw getdents64(), filling one large caller-sized buffer per syscall
+// instead of going through libc's 32KB readdir() buffer.
+// Entry names are slices into that buffer: they're NUL-terminated, but only valid until the next dir_next() call.
+
+#define DIR_DEFAULT_BUFFER_SIZE MB(1)
+
+typedef struct {
+    str_t name;
+    u64 ino;
+    u8 type; // DT_* value, DT_UNKNOWN if the filesystem doesn't report it
+} dir_entry_t;
+
+typedef struct {
+    i32 fd;
+    i32 error; // errno of the failed getdents64() call, 0 otherwise
+    u8* buffer;
+    u64 capacity;
+    u64 position;
+    u64 length;
+} dir_reader_t;
+
+bool dir_reader_init(dir_reader_t* reader, arena_t* arena, u64 buffer_size);
+void dir_reader_open(dir_reader_t* reader, i32 fd);
+bool dir_next(dir_reader_t* reader, dir_entry_t* entry);
+
+#ifdef DIR_IMPLEMENTATION
+
+#include <errno.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct {
+    u64 d_ino;
+    i64 d_off;
+    u16 d_reclen;
+    u8 d_type;
+    c d_name[];
+} dir_linux_dirent64_t;
+
+bool dir_reader_init(dir_reader_t* reader, arena_t* arena, const u64 buffer_size) {
+    assert(reader);
+    assert(arena_valid(arena));
+    assert(buffer_size >= KB(4));
+
+    reader->buffer = arena_alloc_aligned(arena, buffer_size, 64);
+    if (!reader->buffer) {
+        return false;
+    }
+    reader->capacity = buffer_size;
+    dir_reader_open(reader, -1);
+    return true;
+}
+
+// Doesn't take ownership of fd
+void dir_reader_open(dir_reader_t* reader, const i32 fd) {
+    reader->fd = fd;
+    reader->error = 0;
+    reader->position = 0;
+    reader->length = 0;
+}
+
+bool dir_next(dir_reader_t* reader, dir_entry_t* entry) {
+    assert(reader && reader->buffer);
+    assert(entry);
+
+    while (true) {
+        if (reader->position < reader->length) {
+            const dir_linux_dirent64_t* dirent = (const dir_linux_dirent64_t*)(reader->buffer + reader->position);
+            reader->position += dirent->d_reclen;
+
+            const size_t name_length = strlen(dirent->d_name);
+            entry->name = (str_t){
+                .start = (char*)dirent->d_name,
+                .length = name_length,
+                .capacity = name_length
+            };
+            entry->ino = dirent->d_ino;
+            entry->type = dirent->d_type;
+            return true;
+        }
+
+        if (reader->fd < 0) {
+            return false;
+        }
+
+        const long result = syscall(SYS_getdents64, reader->fd, reader->buffer, reader->capacity);
+        if (result <= 0) {
+            reader->error = result < 0 ? errno : 0;
+            reader->fd = -1;
+            return false;
+        }
+
+        reader->position = 0;
+        reader->length = result;
+    }
+}
+
+#endif
@@ -0,0 +1,246 @@
+#pragma once
+
+#ifdef FILE_INDEX_IMPLEMENTATION
+#ifndef ARENA_IMPLEMENTATION
+#define ARENA_IMPLEMENTATION
+#endif
+#endif
+#include "arena.h"
+
+// Persistent, append-only index of per-file results keyed by (dev, ino, size, mtime_ns).
+// The file is a header followed by fixed-size records: new results are appended with O_APPEND writes,
+// a later record for the same (dev, ino) supersedes earlier ones, and file_index_compact() drops superseded records.
+// Records present when the index was opened are memory-mapped and looked up through a read-only hash table,
+// so lookups are lock-free. Records appended during a run only become visible to the next run.
+
+typedef struct {
+    u64 dev;
+    u64 ino;
+    u64 size;
+    i64 mtime_ns;
+} file_index_key_t;
+
+typedef struct {
+    i32 fd;
+    u32 version;
+    u32 payload_size;
+    u64 record_size;
+
+    u8* map;
+    u64 map_size;
+    u64 record_count;
+
+    arena_t arena;
+    const u8** slots; // Latest record per (dev, ino), NULL for empty slots
+    u64 capacity;
+} file_index_t;
+
+bool file_index_open(file_index_t* index, const c* path, u32 version, u32 payload_size);
+const void* file_index_find(const file_index_t* index, const file_index_key_t* key);
+bool file_index_append(file_index_t* index, const file_index_key_t* key, const void* payload);
+bool file_index_compact(file_index_t* index, const c* path);
+void file_index_close(file_index_t* index);
+
+#ifdef FILE_INDEX_IMPLEMENTATION
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FILE_INDEX_MAGIC "AAINDEX\0"
+
+typedef struct {
+    c magic[8];
+    u32 version;
+    u32 payload_size;
+    u64 reserved[2];
+} file_index_header_t;
+
+static const u8** file_index_find_slot(const file_index_t* index, const u64 dev, const u64 ino) {
+    u64 slot = hash_inode(dev, ino) & (index->capacity - 1);
+    while (index->slots[slot]) {
+        const file_index_key_t* key = (const file_index_key_t*)index->slots[slot];
+        if (key->dev == dev && key->ino == ino) {
+            break;
+        }
+        slot = (slot + 1) & (index->capacity - 1);
+    }
+    return &index->slots[slot];
+}
+
+static bool file_index_write_header(const i32 fd, const u32 version, const u32 payload_size) {
+    file_index_header_t header = { .version = version, .payload_size = payload_size };
+    memcpy(header.magic, FILE_INDEX_MAGIC, sizeof(header.magic));
+    return pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+}
+
+static bool file_index_load(file_index_t* index) {
+    struct stat sb;
+    if (fstat(index->fd, &sb) != 0) {
+        return false;
+    }
+
+    file_index_header_t header = { 0 };
+    const bool is_index = sb.st_size >= (off_t)sizeof(header) &&
+                          pread(index->fd, &header, sizeof(header), 0) == sizeof(header) &&
+                          memcmp(header.magic, FILE_INDEX_MAGIC, sizeof(header.magic)) == 0;
+
+    // Anything else non-empty was likely passed by mistake and is never overwritten
+    if (sb.st_size > 0 && !is_index) {
+        printf("Not an index file, leaving it untouched\n");
+        return false;
+    }
+
+    if (!is_index || header.version != index->version || header.payload_size != index->payload_size) {
+        if (sb.st_size > 0) {
+            printf("Index has a different format, starting a new one\n");
+        }
+        if (ftruncate(index->fd, 0) != 0 || !file_index_write_header(index->fd, index->version, index->payload_size)) {
+            return false;
+        }
+        sb.st_size = sizeof(header);
+    }
+
+    // A record torn by an interrupted run is dropped
+    index->record_count = (sb.st_size - sizeof(header)) / index->record_size;
+    const u64 used_size = sizeof(header) + index->record_count * index->record_size;
+    if ((u64)sb.st_size != used_size && ftruncate(index->fd, used_size) != 0) {
+        return false;
+    }
+
+    index->capacity = 1024;
+    while (index->capacity < index->record_count * 2) {
+        index->capacity *= 2;
+    }
+    index->arena = arena_make(sizeof(u8*) * index->capacity);
+    if (!arena_valid(&index->arena)) {
+        return false;
+    }
+    index->slots = arena_alloc(&index->arena, sizeof(u8*) * index->capacity);
+    memset(index->slots, 0, sizeof(u8*) * index->capacity);
+
+    if (index->record_count == 0) {
+        return true;
+    }
+
+    index->map_size = used_size;
+    index->map = mmap(NULL, index->map_size, PROT_READ, MAP_SHARED, index->fd, 0);
+    if (index->map == MAP_FAILED) {
+        index->map = NULL;
+        return false;
+    }
+    madvise(index->map, index->map_size, MADV_SEQUENTIAL);
+
+    const u8* record = index->map + sizeof(header);
+    for (u64 i = 0; i < index->record_count; i++, record += index->record_size) {
+        const file_index_key_t* key = (const file_index_key_t*)record;
+        *file_index_find_slot(index, key->dev, key->ino) = record;
+    }
+    return true;
+}
+
+// Creates the index if path doesn't exist and starts over if it's an index of another version or payload size.
+// Returns false without touching it if path is a non-empty file that isn't an index
+bool file_index_open(file_index_t* index, const c* path, const u32 version, const u32 payload_size) {
+    assert(index);
+    assert(path);
+
+    memset(index, 0, sizeof(file_index_t));
+    index->version = version;
+    index->payload_size = payload_size;
+    index->record_size = align_size(sizeof(file_index_key_t) + payload_size, 8);
+
+    index->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (index->fd == -1) {
+        return false;
+    }
+
+    if (!file_index_load(index)) {
+        file_index_close(index);
+        return false;
+    }
+    return true;
+}
+
+// Returns the stored payload if (dev, ino) is indexed with the same size and mtime, NULL otherwise
+const void* file_index_find(const file_index_t* index, const file_index_key_t* key) {
+    const u8* record = *file_index_find_slot(index, key->dev, key->ino);
+    if (!record) {
+        return NULL;
+    }
+
+    const file_index_key_t* stored = (const file_index_key_t*)record;
+    if (stored->size != key->size || stored->mtime_ns != key->mtime_ns) {
+        return NULL;
+    }
+    return record + sizeof(file_index_key_t);
+}
+
+// Safe to call from multiple threads, every record goes out in a single O_APPEND write
+bool file_index_append(file_index_t* index, const file_index_key_t* key, const void* payload) {
+    u8 record[index->record_size];
+    memset(record, 0, index->record_size);
+    memcpy(record, key, sizeof(file_index_key_t));
+    memcpy(record + sizeof(file_index_key_t), payload, index->payload_size);
+
+    ssize_t result;
+    do {
+        result = write(index->fd, record, index->record_size);
+    } while (result < 0 && errno == EINTR);
+    return result == (ssize_t)index->record_size;
+}
+
+// Rewrites the index with only the latest record per (dev, ino), then reloads it.
+// Must not run concurrently with lookups or appends
+bool file_index_compact(file_index_t* index, const c* path) {
+    const size_t path_length = strlen(path);
+    c temp_path[path_length + sizeof(".compact")];
+    memcpy(temp_path, path, path_length);
+    memcpy(temp_path + path_length, ".compact", sizeof(".compact"));
+
+    const i32 fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+
+    bool ok = file_index_write_header(fd, index->version, index->payload_size);
+    off_t offset = sizeof(file_index_header_t);
+    for (u64 i = 0; ok && i < index->capacity; i++) {
+        if (index->slots[i]) {
+            ok = pwrite(fd, index->slots[i], index->record_size, offset) == (ssize_t)index->record_size;
+            offset += index->record_size;
+        }
+    }
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+
+    if (!ok || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return false;
+    }
+
+    const u32 version = index->version;
+    const u32 payload_size = index->payload_size;
+    file_index_close(index);
+    return file_index_open(index, path, version, payload_size);
+}
+
+void file_index_close(file_index_t* index) {
+    if (index->map) {
+        munmap(index->map, index->map_size);
+    }
+    if (arena_valid(&index->arena)) {
+        arena_delete(&index->arena);
+    }
+    if (index->fd >= 0) {
+        close(index->fd);
+    }
+    memset(index, 0, sizeof(file_index_t));
+    index->fd = -1;
+}
+
+#endif
@@ -0,0 +1,147 @@
+#pragma once
+
+#ifdef INODE_SET_IMPLEMENTATION
+#ifndef ARENA_IMPLEMENTATION
+#define ARENA_IMPLEMENTATION
+#endif
+#endif
+#include "arena.h"
+
+#include <pthread.h>
+
+// Concurrent hash set of (dev, ino) pairs, each mapped to a caller-owned value.
+// Keys are spread over INODE_SET_STRIPES independently locked open-addressing tables.
+// Every table has an arena of its own sized to fit, growing maps one twice the size and unmaps the outgrown one,
+// so the set is only limited by memory.
+
+#define INODE_SET_STRIPES 32
+#define INODE_SET_INITIAL_CAPACITY 1024
+
+typedef struct {
+    u64 dev;
+    u64 ino;
+    void* value; // NULL marks an empty slot
+} inode_set_slot_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    arena_t arena; // Holds slots and nothing else
+    inode_set_slot_t* slots;
+    u64 capacity;
+    u64 count;
+} inode_set_stripe_t;
+
+typedef struct {
+    inode_set_stripe_t stripes[INODE_SET_STRIPES];
+    a_u64 untracked_count; // Pairs treated as new without being remembered, their stripe couldn't grow
+} inode_set_t;
+
+bool inode_set_init(inode_set_t* set);
+void* inode_set_insert(inode_set_t* set, u64 dev, u64 ino, void* value);
+void inode_set_delete(inode_set_t* set);
+
+#ifdef INODE_SET_IMPLEMENTATION
+
+#include <stdio.h>
+
+// Fresh anonymous mappings are zeroed, so every slot starts out empty
+static bool inode_set_stripe_alloc(inode_set_stripe_t* stripe, const u64 capacity) {
+    arena_t arena = arena_make(sizeof(inode_set_slot_t) * capacity);
+    if (!arena_valid(&arena)) {
+        return false;
+    }
+    stripe->arena = arena;
+    stripe->slots = arena_alloc(&stripe->arena, sizeof(inode_set_slot_t) * capacity);
+    stripe->capacity = capacity;
+    return true;
+}
+
+bool inode_set_init(inode_set_t* set) {
+    assert(set);
+
+    atomic_init(&set->untracked_count, 0);
+    for (u32 i = 0; i < INODE_SET_STRIPES; i++) {
+        inode_set_stripe_t* stripe = &set->stripes[i];
+        pthread_mutex_init(&stripe->mutex, NULL);
+        stripe->count = 0;
+        if (!inode_set_stripe_alloc(stripe, INODE_SET_INITIAL_CAPACITY)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inode_set_slot_t* inode_set_find_slot(inode_set_slot_t* slots, const u64 capacity, const u64 hash, const u64 dev, const u64 ino) {
+    u64 index = hash & (capacity - 1);
+    while (slots[index].value && (slots[index].dev != dev || slots[index].ino != ino)) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return &slots[index];
+}
+
+static bool inode_set_grow(inode_set_stripe_t* stripe) {
+    arena_t old_arena = stripe->arena;
+    const inode_set_slot_t* old_slots = stripe->slots;
+    const u64 old_capacity = stripe->capacity;
+
+    if (!inode_set_stripe_alloc(stripe, old_capacity * 2)) {
+        return false;
+    }
+
+    for (u64 i = 0; i < old_capacity; i++) {
+        if (old_slots[i].value) {
+            const u64 hash = hash_inode(old_slots[i].dev, old_slots[i].ino);
+            *inode_set_find_slot(stripe->slots, stripe->capacity, hash, old_slots[i].dev, old_slots[i].ino) = old_slots[i];
+        }
+    }
+    arena_delete(&old_arena);
+    return true;
+}
+
+// Inserts (dev, ino) -> value unless the pair is already present.
+// Returns NULL if value was inserted, the value already mapped to (dev, ino) otherwise.
+// If the stripe's table can't be grown the pair is treated as new but not remembered, with a warning the first time
+void* inode_set_insert(inode_set_t* set, const u64 dev, const u64 ino, void* value) {
+    assert(set);
+    assert(value);
+
+    const u64 hash = hash_inode(dev, ino);
+    inode_set_stripe_t* stripe = &set->stripes[hash >> 59 & (INODE_SET_STRIPES - 1)];
+
+    pthread_mutex_lock(&stripe->mutex);
+
+    inode_set_slot_t* slot = inode_set_find_slot(stripe->slots, stripe->capacity, hash, dev, ino);
+    if (slot->value) {
+        void* existing = slot->value;
+        pthread_mutex_unlock(&stripe->mutex);
+        return existing;
+    }
+
+    if ((stripe->count + 1) * 2 > stripe->capacity) {
+        if (!inode_set_grow(stripe)) {
+            pthread_mutex_unlock(&stripe->mutex);
+            if (atomic_fetch_add(&set->untracked_count, 1) == 0) {
+                printf("Out of memory for de-duplication, hard links and bind mounts found from here on are analyzed once per path\n");
+            }
+            return NULL;
+        }
+        slot = inode_set_find_slot(stripe->slots, stripe->capacity, hash, dev, ino);
+    }
+
+    *slot = (inode_set_slot_t){ .dev = dev, .ino = ino, .value = value };
+    stripe->count++;
+
+    pthread_mutex_unlock(&stripe->mutex);
+    return NULL;
+}
+
+void inode_set_delete(inode_set_t* set) {
+    for (u32 i = 0; i < INODE_SET_STRIPES; i++) {
+        if (arena_valid(&set->stripes[i].arena)) {
+            arena_delete(&set->stripes[i].arena);
+        }
+        pthread_mutex_destroy(&set->stripes[i].mutex);
+    }
+}
+
+#endif
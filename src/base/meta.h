@@ -0,0 +1,183 @@
+#pragma once
+
+#ifdef META_IMPLEMENTATION
+#ifndef URING_IMPLEMENTATION
+#define URING_IMPLEMENTATION
+#endif
+#endif
+#include "uring.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Batched file metadata engine: statx() and openat() for many files relative to directory fds.
+// With io_uring a batch is kept in flight up to depth operations at a time,
+// without it (old kernel, seccomp, io_uring_disabled) the same calls are made synchronously.
+// If io_uring fails midway, the engine finishes the batch synchronously and stays synchronous.
+// An engine is meant to be driven by a single thread.
+
+#define META_STATX (1u << 0)
+#define META_OPEN (1u << 1)
+
+#define META_STATX_MASK (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | STATX_SIZE | STATX_MTIME)
+
+typedef struct {
+    i32 dir_fd;
+    const c* name;
+
+    struct statx stx;
+    i32 stat_result; // 0 or -errno
+    i32 fd;          // Opened fd or -errno
+} meta_op_t;
+
+typedef struct {
+    uring_t ring;
+    bool use_uring;
+    u32 depth;
+} meta_t;
+
+void meta_init(meta_t* meta, u32 depth, bool try_uring);
+void meta_delete(meta_t* meta);
+void meta_run(meta_t* meta, meta_op_t* ops, u64 count, u32 what);
+
+#ifdef META_IMPLEMENTATION
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define META_OPEN_FLAGS (O_RDONLY | O_CLOEXEC)
+#define META_PENDING INT32_MIN // stat_result or fd of a call queued on the ring that hasn't completed
+
+void meta_init(meta_t* meta, const u32 depth, const bool try_uring) {
+    assert(meta);
+    assert(is_power_of_two(depth) && depth >= 2);
+
+    meta->use_uring = false;
+    meta->depth = depth;
+
+    if (try_uring && uring_init(&meta->ring, depth)) {
+        const u8 opcodes[] = { IORING_OP_STATX, IORING_OP_OPENAT };
+        if (uring_supports(&meta->ring, opcodes, sizeof(opcodes))) {
+            meta->use_uring = true;
+        } else {
+            uring_exit(&meta->ring);
+        }
+    }
+}
+
+void meta_delete(meta_t* meta) {
+    if (meta->use_uring) {
+        uring_exit(&meta->ring);
+        meta->use_uring = false;
+    }
+}
+
+static void meta_run_op_sync(meta_op_t* op, const u32 what) {
+    if (what & META_STATX) {
+        op->stat_result = statx(op->dir_fd, op->name, 0, META_STATX_MASK, &op->stx) == 0 ? 0 : -errno;
+    }
+    if (what & META_OPEN) {
+        const i32 fd = openat(op->dir_fd, op->name, META_OPEN_FLAGS);
+        op->fd = fd >= 0 ? fd : -errno;
+    }
+}
+
+static void meta_run_sync(meta_op_t* ops, const u64 count, const u32 what) {
+    for (u64 i = 0; i < count; i++) {
+        meta_run_op_sync(&ops[i], what);
+    }
+}
+
+// user_data is the op index shifted left by one, with the low bit telling statx (0) from openat (1)
+static void meta_reap(meta_t* meta, meta_op_t* ops, u32* in_flight) {
+    struct io_uring_cqe* cqe;
+    while ((cqe = uring_peek_cqe(&meta->ring)) != NULL) {
+        meta_op_t* op = &ops[cqe->user_data >> 1];
+        if (cqe->user_data & 1) {
+            op->fd = cqe->res;
+        } else {
+            op->stat_result = cqe->res < 0 ? cqe->res : 0;
+        }
+        uring_cqe_seen(&meta->ring);
+        (*in_flight)--;
+    }
+}
+
+// After io_uring_enter failed: takes back what wasn't submitted and waits for what was, so the kernel is done
+// with ops, then makes every call that didn't complete synchronously. ops from queued_count on were never queued
+static void meta_fall_back(meta_t* meta, meta_op_t* ops, const u64 count, const u64 queued_count, const u32 what, u32 in_flight) {
+    in_flight -= uring_discard_unsubmitted(&meta->ring);
+    while (in_flight > 0) {
+        const i32 result = uring_submit(&meta->ring, 1);
+        if (result < 0 && result != -EAGAIN && result != -EBUSY) {
+            break; // Tearing the ring down below cancels whatever is left
+        }
+        meta_reap(meta, ops, &in_flight);
+    }
+    uring_exit(&meta->ring);
+    meta->use_uring = false;
+
+    for (u64 i = 0; i < count; i++) {
+        meta_op_t* op = &ops[i];
+        u32 left = what;
+        if (i < queued_count) {
+            left = ((what & META_STATX) && op->stat_result == META_PENDING ? META_STATX : 0) |
+                   ((what & META_OPEN) && op->fd == META_PENDING ? META_OPEN : 0);
+        }
+        meta_run_op_sync(op, left);
+    }
+}
+
+void meta_run(meta_t* meta, meta_op_t* ops, const u64 count, const u32 what) {
+    assert(meta);
+    assert(what & (META_STATX | META_OPEN));
+
+    if (!meta->use_uring) {
+        meta_run_sync(ops, count, what);
+        return;
+    }
+
+    const u32 ops_per_file = ((what & META_STATX) ? 1 : 0) + ((what & META_OPEN) ? 1 : 0);
+    u64 next = 0;
+    u32 in_flight = 0;
+
+    while (next < count || in_flight > 0) {
+        while (next < count && in_flight + ops_per_file <= meta->depth) {
+            meta_op_t* op = &ops[next];
+            if (what & META_STATX) {
+                struct io_uring_sqe* sqe = uring_get_sqe(&meta->ring);
+                sqe->opcode = IORING_OP_STATX;
+                sqe->fd = op->dir_fd;
+                sqe->addr = (u64)(uptr)op->name;
+                sqe->len = META_STATX_MASK;
+                sqe->off = (u64)(uptr)&op->stx;
+                sqe->user_data = next << 1;
+                op->stat_result = META_PENDING;
+            }
+            if (what & META_OPEN) {
+                struct io_uring_sqe* sqe = uring_get_sqe(&meta->ring);
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->fd = op->dir_fd;
+                sqe->addr = (u64)(uptr)op->name;
+                sqe->open_flags = META_OPEN_FLAGS;
+                sqe->user_data = (next << 1) | 1;
+                op->fd = META_PENDING;
+            }
+            in_flight += ops_per_file;
+            next++;
+        }
+
+        const i32 result = uring_submit(&meta->ring, 1);
+        if (result < 0 && result != -EAGAIN && result != -EBUSY) {
+            printf("io_uring_enter failed: %s, making metadata calls synchronously from here on\n", strerror(-result));
+            meta_fall_back(meta, ops, count, next, what, in_flight);
+            return;
+        }
+
+        meta_reap(meta, ops, &in_flight);
+    }
+}
+
+#endif
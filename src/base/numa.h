@@ -0,0 +1,108 @@
+#pragma once
+
+#ifdef NUMA_IMPLEMENTATION
+#ifndef TOPO_IMPLEMENTATION
+#define TOPO_IMPLEMENTATION
+#endif
+#endif
+#include "topo.h"
+
+// NUMA topology from /sys/devices/system/node and memory placement on raw syscalls, no libnuma dependency.
+// Only nodes with memory and with CPUs this process may run on are listed.
+
+#define NUMA_MAX_NODES 64
+
+typedef struct {
+    u32 node_count;
+    u32 nodes[NUMA_MAX_NODES];      // Kernel node ids, below NUMA_MAX_NODES
+    cpu_set_t cpus[NUMA_MAX_NODES]; // CPUs of each node within the process affinity
+} numa_t;
+
+bool numa_discover(numa_t* numa);
+i32 numa_index_of(const numa_t* numa, i32 node);
+bool numa_bind(void* start, u64 size, u32 node);
+bool numa_prefer(i32 node);
+i32 numa_node_of(const void* address);
+
+#ifdef NUMA_IMPLEMENTATION
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/mempolicy.h>
+
+#define NUMA_MASK_BITS (sizeof(unsigned long) * 8)
+
+// Returns false if the topology can't be read, e.g. on kernels built without NUMA
+bool numa_discover(numa_t* numa) {
+    assert(numa);
+
+    memset(numa, 0, sizeof(numa_t));
+
+    cpu_set_t nodes;
+    cpu_set_t affinity;
+    if (!topo_read_cpu_list("/sys/devices/system/node/has_memory", &nodes) ||
+        sched_getaffinity(0, sizeof(affinity), &affinity) != 0) {
+        return false;
+    }
+
+    for (u32 node = 0; node < NUMA_MAX_NODES; node++) {
+        if (!CPU_ISSET(node, &nodes)) {
+            continue;
+        }
+        c path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+        cpu_set_t* cpus = &numa->cpus[numa->node_count];
+        if (!topo_read_cpu_list(path, cpus)) {
+            continue;
+        }
+        CPU_AND(cpus, cpus, &affinity);
+        if (CPU_COUNT(cpus) > 0) {
+            numa->nodes[numa->node_count++] = node;
+        }
+    }
+    return numa->node_count > 0;
+}
+
+// Position of a kernel node id in numa->nodes, -1 if it isn't listed
+i32 numa_index_of(const numa_t* numa, const i32 node) {
+    for (u32 i = 0; i < numa->node_count; i++) {
+        if ((i32)numa->nodes[i] == node) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Prefers node for the pages of [start, start + size), start must be page aligned.
+// Applies to pages faulted in later, including after MADV_DONTNEED
+bool numa_bind(void* start, const u64 size, const u32 node) {
+    unsigned long mask[NUMA_MAX_NODES / NUMA_MASK_BITS] = { 0 };
+    mask[node / NUMA_MASK_BITS] = 1ul << (node % NUMA_MASK_BITS);
+    return syscall(SYS_mbind, start, size, MPOL_PREFERRED, mask, NUMA_MAX_NODES + 1, 0) == 0;
+}
+
+// Prefers node for the calling thread's future allocations, including page cache it reads in.
+// A negative node goes back to the default local policy
+bool numa_prefer(const i32 node) {
+    if (node < 0) {
+        return syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0) == 0;
+    }
+    unsigned long mask[NUMA_MAX_NODES / NUMA_MASK_BITS] = { 0 };
+    mask[node / NUMA_MASK_BITS] = 1ul << (node % NUMA_MASK_BITS);
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, NUMA_MAX_NODES + 1) == 0;
+}
+
+// Node holding the page at address, -1 if unknown.
+// A page that isn't resident yet gets faulted in, check mincore() first where that matters
+i32 numa_node_of(const void* address) {
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, address, MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+        return -1;
+    }
+    return node;
+}
+
+#endif
@@ -0,0 +1,170 @@
+#pragma once
+
+#ifdef QUEUE_IMPLEMENTATION
+#ifndef ARENA_IMPLEMENTATION
+#define ARENA_IMPLEMENTATION
+#endif
+#endif
+#include "arena.h"
+
+#include <semaphore.h>
+
+// Bounded FIFO of pointers, multi-producer/multi-consumer.
+// The ring itself is lock-free (Vyukov's bounded MPMC queue: every cell carries a sequence number
+// telling producers and consumers whose turn it is), two semaphores count free and filled cells
+// so producers block while the queue is full and consumers block while it's empty.
+// After queue_close() pushes fail and pops drain the remaining items, then fail.
+// Capacity must be a power of two.
+
+typedef struct {
+    a_u64 sequence;
+    void* item;
+} queue_cell_t;
+
+typedef struct {
+    queue_cell_t* cells;
+    u64 mask;
+    sem_t free_cells;
+    sem_t filled_cells;
+    atomic_bool closed;
+
+    _Alignas(CACHE_LINE_SIZE) a_u64 push_position;
+    _Alignas(CACHE_LINE_SIZE) a_u64 pop_position;
+} queue_t;
+
+bool queue_init(queue_t* queue, arena_t* arena, u64 capacity);
+bool queue_push(queue_t* queue, void* item);
+bool queue_pop(queue_t* queue, void** item);
+bool queue_try_pop(queue_t* queue, void** item);
+void queue_close(queue_t* queue);
+
+#ifdef QUEUE_IMPLEMENTATION
+
+#include <errno.h>
+#include <sched.h>
+
+bool queue_init(queue_t* queue, arena_t* arena, const u64 capacity) {
+    assert(queue);
+    assert(arena_valid(arena));
+    assert(is_power_of_two(capacity));
+
+    queue->cells = arena_alloc_aligned(arena, sizeof(queue_cell_t) * capacity, CACHE_LINE_SIZE);
+    if (!queue->cells) {
+        return false;
+    }
+
+    for (u64 i = 0; i < capacity; i++) {
+        atomic_init(&queue->cells[i].sequence, i);
+        queue->cells[i].item = NULL;
+    }
+    queue->mask = capacity - 1;
+    atomic_init(&queue->push_position, 0);
+    atomic_init(&queue->pop_position, 0);
+    atomic_init(&queue->closed, false);
+    sem_init(&queue->free_cells, 0, capacity);
+    sem_init(&queue->filled_cells, 0, 0);
+    return true;
+}
+
+static void queue_wait(sem_t* sem) {
+    while (sem_wait(sem) != 0 && errno == EINTR) {
+    }
+}
+
+// A cell is ours to fill when its sequence equals the position
+static bool queue_ring_push(queue_t* queue, void* item) {
+    u64 position = atomic_load_explicit(&queue->push_position, memory_order_relaxed);
+    while (true) {
+        queue_cell_t* cell = &queue->cells[position & queue->mask];
+        const i64 difference = (i64)atomic_load_explicit(&cell->sequence, memory_order_acquire) - (i64)position;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->push_position, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                cell->item = item;
+                atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = atomic_load_explicit(&queue->push_position, memory_order_relaxed);
+        }
+    }
+}
+
+// A cell is ours to drain when its sequence is one past the position
+static bool queue_ring_pop(queue_t* queue, void** item) {
+    u64 position = atomic_load_explicit(&queue->pop_position, memory_order_relaxed);
+    while (true) {
+        queue_cell_t* cell = &queue->cells[position & queue->mask];
+        const i64 difference = (i64)atomic_load_explicit(&cell->sequence, memory_order_acquire) - (i64)(position + 1);
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->pop_position, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                *item = cell->item;
+                atomic_store_explicit(&cell->sequence, position + queue->mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = atomic_load_explicit(&queue->pop_position, memory_order_relaxed);
+        }
+    }
+}
+
+bool queue_push(queue_t* queue, void* item) {
+    queue_wait(&queue->free_cells);
+    if (atomic_load_explicit(&queue->closed, memory_order_acquire)) {
+        // Pass the wake-up from queue_close() on to the next blocked producer
+        sem_post(&queue->free_cells);
+        return false;
+    }
+
+    // The semaphore guarantees a free cell, but a consumer may still be between claiming and releasing it
+    while (!queue_ring_push(queue, item)) {
+        sched_yield();
+    }
+    sem_post(&queue->filled_cells);
+    return true;
+}
+
+bool queue_pop(queue_t* queue, void** item) {
+    queue_wait(&queue->filled_cells);
+
+    // The semaphore guarantees a filled cell or a close, but the producer of the next cell
+    // in line may still be between claiming and publishing it
+    while (!queue_ring_pop(queue, item)) {
+        if (atomic_load_explicit(&queue->closed, memory_order_acquire) && !queue_ring_pop(queue, item)) {
+            // Pass the wake-up from queue_close() on to the next blocked consumer
+            sem_post(&queue->filled_cells);
+            return false;
+        }
+        sched_yield();
+    }
+    sem_post(&queue->free_cells);
+    return true;
+}
+
+// Like queue_pop(), but returns false instead of blocking while the queue is empty
+bool queue_try_pop(queue_t* queue, void** item) {
+    if (sem_trywait(&queue->filled_cells) != 0) {
+        return false;
+    }
+    while (!queue_ring_pop(queue, item)) {
+        if (atomic_load_explicit(&queue->closed, memory_order_acquire) && !queue_ring_pop(queue, item)) {
+            sem_post(&queue->filled_cells);
+            return false;
+        }
+        sched_yield();
+    }
+    sem_post(&queue->free_cells);
+    return true;
+}
+
+// Must be called after the last push has returned
+void queue_close(queue_t* queue) {
+    atomic_store_explicit(&queue->closed, true, memory_order_release);
+    sem_post(&queue->filled_cells);
+    sem_post(&queue->free_cells);
+}
+
+#endif
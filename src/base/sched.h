@@ -0,0 +1,406 @@
+#pragma once
+
+#ifdef SCHED_IMPLEMENTATION
+#ifndef QUEUE_IMPLEMENTATION
+#define QUEUE_IMPLEMENTATION
+#endif
+#endif
+#include "queue.h"
+
+#include <pthread.h>
+
+// Work-stealing task scheduler.
+// Every worker owns a Chase-Lev deque: it pushes and pops its own tasks at the bottom (LIFO, cache-warm),
+// idle workers steal from the top of a random victim's deque (FIFO, oldest and usually largest first).
+// Tasks from outside the pool go through bounded injection queues, so submitters block when they get ahead.
+// Workers can be split into groups (e.g. one per NUMA node), each with its own injection queue:
+// an idle worker looks at its own group's queue and deques before taking work from other groups.
+// Workers with nothing to run or steal sleep until a task is submitted or spawned.
+// sched_set_active() parks the workers above a limit between tasks, their queued tasks are left to be stolen.
+// The scheduler is done once it's closed and every submitted or spawned task has finished.
+
+#define SCHED_DEQUE_INITIAL_CAPACITY 256
+#define SCHED_WORKER_ARENA_SIZE MB(64)
+
+typedef struct sched_t sched_t;
+typedef struct sched_task_t sched_task_t;
+
+// worker_index identifies the running worker, for sched_spawn() and per-worker state
+typedef void (*sched_task_fn)(sched_task_t* task, u32 worker_index);
+
+// Run by a worker that found nothing to do, right before it sleeps
+typedef void (*sched_idle_fn)(u32 worker_index);
+
+// Embedded into the caller's task struct, which must stay alive until the task has run
+struct sched_task_t {
+    sched_task_fn run;
+};
+
+typedef struct {
+    i64 mask;
+    _Atomic(sched_task_t*) tasks[];
+} sched_deque_buffer_t;
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) a_i64 top;
+    _Alignas(CACHE_LINE_SIZE) a_i64 bottom;
+    _Atomic(sched_deque_buffer_t*) buffer;
+} sched_deque_t;
+
+typedef struct {
+    sched_deque_t deque;
+    sched_t* sched;
+    pthread_t thread;
+    arena_t arena; // Deque buffers, outgrown ones are left behind since thieves may still read them
+    u32 index;
+    u32 group;
+    u64 random;
+
+    u64 executed;
+    u64 stolen;
+} sched_worker_t;
+
+struct sched_t {
+    sched_worker_t* workers;
+    u32 worker_count;
+    u32 group_count;
+    queue_t* injection; // One per group
+    a_u32 next_group;   // Round robin for sched_submit()
+    a_u32 active;       // Workers with a lower index run tasks, the rest are parked
+    sched_idle_fn idle; // Optional, set before sched_start()
+
+    a_u64 pending; // Submitted or spawned tasks that haven't finished yet
+    atomic_bool closed;
+    atomic_bool done;
+
+    a_u64 epoch; // Bumped whenever work shows up, sleepers recheck before waiting
+    a_u32 sleepers;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+sched_t* sched_make(arena_t* arena, u32 worker_count, u32 group_count, u64 injection_capacity);
+bool sched_start(sched_t* sched, const cpu_set_t* worker_cpus);
+void sched_submit(sched_t* sched, sched_task_t* task);
+void sched_submit_to(sched_t* sched, u32 group, sched_task_t* task);
+void sched_spawn(sched_t* sched, u32 worker_index, sched_task_t* task);
+void sched_set_active(sched_t* sched, u32 count);
+void sched_close(sched_t* sched);
+void sched_join(sched_t* sched);
+void sched_delete(sched_t* sched);
+
+#ifdef SCHED_IMPLEMENTATION
+
+#include <string.h>
+
+// Workers are split into group_count contiguous groups of (nearly) equal size
+sched_t* sched_make(arena_t* arena, const u32 worker_count, const u32 group_count, const u64 injection_capacity) {
+    assert(arena_valid(arena));
+    assert(worker_count > 0);
+    assert(group_count > 0 && group_count <= worker_count);
+
+    sched_t* sched = arena_alloc_aligned(arena, sizeof(sched_t), CACHE_LINE_SIZE);
+    sched_worker_t* workers = arena_alloc_aligned(arena, sizeof(sched_worker_t) * worker_count, CACHE_LINE_SIZE);
+    queue_t* injection = arena_alloc_aligned(arena, sizeof(queue_t) * group_count, CACHE_LINE_SIZE);
+    if (!sched || !workers || !injection) {
+        return NULL;
+    }
+
+    memset(sched, 0, sizeof(sched_t));
+    sched->workers = workers;
+    sched->worker_count = worker_count;
+    sched->group_count = group_count;
+    sched->injection = injection;
+    atomic_init(&sched->active, worker_count);
+    for (u32 i = 0; i < group_count; i++) {
+        if (!queue_init(&injection[i], arena, injection_capacity)) {
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&sched->mutex, NULL);
+    pthread_cond_init(&sched->cond, NULL);
+
+    for (u32 i = 0; i < worker_count; i++) {
+        memset(&workers[i], 0, sizeof(sched_worker_t));
+        workers[i].sched = sched;
+        workers[i].index = i;
+        workers[i].group = (u64)i * group_count / worker_count;
+        workers[i].random = 0x9E3779B97F4A7C15ull * (i + 1);
+    }
+    return sched;
+}
+
+static sched_deque_buffer_t* sched_deque_buffer_make(sched_worker_t* worker, const i64 capacity) {
+    sched_deque_buffer_t* buffer = arena_alloc_aligned(&worker->arena, sizeof(sched_deque_buffer_t) + sizeof(sched_task_t*) * capacity, CACHE_LINE_SIZE);
+    if (buffer) {
+        buffer->mask = capacity - 1;
+    }
+    return buffer;
+}
+
+// Owner only, returns false if the deque is full and can't grow
+static bool sched_deque_push(sched_worker_t* worker, sched_task_t* task) {
+    sched_deque_t* deque = &worker->deque;
+    const i64 bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    const i64 top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    sched_deque_buffer_t* buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+
+    if (bottom - top > buffer->mask) {
+        sched_deque_buffer_t* grown = sched_deque_buffer_make(worker, (buffer->mask + 1) * 2);
+        if (!grown) {
+            return false;
+        }
+        for (i64 i = top; i < bottom; i++) {
+            atomic_store_explicit(&grown->tasks[i & grown->mask], atomic_load_explicit(&buffer->tasks[i & buffer->mask], memory_order_relaxed), memory_order_relaxed);
+        }
+        atomic_store_explicit(&deque->buffer, grown, memory_order_release);
+        buffer = grown;
+    }
+
+    atomic_store_explicit(&buffer->tasks[bottom & buffer->mask], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return true;
+}
+
+// Owner only
+static sched_task_t* sched_deque_pop(sched_deque_t* deque) {
+    const i64 bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    sched_deque_buffer_t* buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    i64 top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    sched_task_t* task = atomic_load_explicit(&buffer->tasks[bottom & buffer->mask], memory_order_relaxed);
+    if (top == bottom) {
+        // Last task, race thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+// Any thread. Returns NULL if the deque looked empty or another thief won the race
+static sched_task_t* sched_deque_steal(sched_deque_t* deque) {
+    i64 top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    const i64 bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    sched_deque_buffer_t* buffer = atomic_load_explicit(&deque->buffer, memory_order_acquire);
+    sched_task_t* task = atomic_load_explicit(&buffer->tasks[top & buffer->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+static void sched_notify(sched_t* sched) {
+    atomic_fetch_add(&sched->epoch, 1);
+    if (atomic_load(&sched->sleepers) > 0) {
+        pthread_mutex_lock(&sched->mutex);
+        pthread_cond_broadcast(&sched->cond);
+        pthread_mutex_unlock(&sched->mutex);
+    }
+}
+
+static void sched_finish_task(sched_t* sched) {
+    if (atomic_fetch_sub(&sched->pending, 1) == 1 && atomic_load(&sched->closed)) {
+        atomic_store(&sched->done, true);
+        sched_notify(sched);
+    }
+}
+
+static u64 sched_next_random(sched_worker_t* worker) {
+    u64 x = worker->random;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return worker->random = x;
+}
+
+// One round over the other workers in (or outside) the worker's group, starting at a random victim
+static sched_task_t* sched_steal(sched_worker_t* worker, const bool own_group) {
+    sched_t* sched = worker->sched;
+    const u32 start = sched_next_random(worker) % sched->worker_count;
+    for (u32 i = 0; i < sched->worker_count; i++) {
+        sched_worker_t* victim = &sched->workers[(start + i) % sched->worker_count];
+        if (victim == worker || (victim->group == worker->group) != own_group) {
+            continue;
+        }
+        sched_task_t* task = sched_deque_steal(&victim->deque);
+        if (task) {
+            worker->stolen++;
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static sched_task_t* sched_find_task(sched_worker_t* worker) {
+    sched_t* sched = worker->sched;
+
+    sched_task_t* task = sched_deque_pop(&worker->deque);
+    if (task) {
+        return task;
+    }
+
+    if (queue_try_pop(&sched->injection[worker->group], (void**)&task)) {
+        return task;
+    }
+    if ((task = sched_steal(worker, true))) {
+        return task;
+    }
+
+    // Nothing left nearby, help the other groups
+    for (u32 i = 1; i < sched->group_count; i++) {
+        if (queue_try_pop(&sched->injection[(worker->group + i) % sched->group_count], (void**)&task)) {
+            return task;
+        }
+    }
+    return sched_steal(worker, false);
+}
+
+static void* sched_worker_main(void* arg) {
+    sched_worker_t* worker = arg;
+    sched_t* sched = worker->sched;
+
+    while (true) {
+        const u64 epoch = atomic_load(&sched->epoch);
+
+        const bool parked = worker->index >= atomic_load(&sched->active);
+        sched_task_t* task = parked ? NULL : sched_find_task(worker);
+        if (task) {
+            task->run(task, worker->index);
+            worker->executed++;
+            sched_finish_task(sched);
+            continue;
+        }
+
+        if (atomic_load(&sched->done)) {
+            break;
+        }
+
+        if (sched->idle) {
+            sched->idle(worker->index);
+        }
+
+        // A steal may have lost a race on a non-empty deque, but then the winner is running something
+        // and whatever it spawns bumps the epoch
+        pthread_mutex_lock(&sched->mutex);
+        atomic_fetch_add(&sched->sleepers, 1);
+        if (atomic_load(&sched->epoch) == epoch && !atomic_load(&sched->done)) {
+            pthread_cond_wait(&sched->cond, &sched->mutex);
+        }
+        atomic_fetch_sub(&sched->sleepers, 1);
+        pthread_mutex_unlock(&sched->mutex);
+    }
+    return NULL;
+}
+
+// worker_cpus pins worker i to worker_cpus[i], NULL leaves the workers unpinned
+bool sched_start(sched_t* sched, const cpu_set_t* worker_cpus) {
+    assert(sched);
+
+    for (u32 i = 0; i < sched->worker_count; i++) {
+        sched_worker_t* worker = &sched->workers[i];
+        worker->arena = arena_make(SCHED_WORKER_ARENA_SIZE);
+        if (!arena_valid(&worker->arena)) {
+            return false;
+        }
+        sched_deque_buffer_t* buffer = sched_deque_buffer_make(worker, SCHED_DEQUE_INITIAL_CAPACITY);
+        if (!buffer) {
+            return false;
+        }
+        atomic_init(&worker->deque.top, 0);
+        atomic_init(&worker->deque.bottom, 0);
+        atomic_init(&worker->deque.buffer, buffer);
+    }
+
+    for (u32 i = 0; i < sched->worker_count; i++) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (worker_cpus) {
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &worker_cpus[i]);
+        }
+        const bool created = pthread_create(&sched->workers[i].thread, &attr, sched_worker_main, &sched->workers[i]) == 0;
+        pthread_attr_destroy(&attr);
+        if (!created) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// From any thread but the workers, blocks while the group's injection queue is full
+void sched_submit_to(sched_t* sched, const u32 group, sched_task_t* task) {
+    assert(!atomic_load(&sched->closed));
+    assert(group < sched->group_count);
+
+    atomic_fetch_add(&sched->pending, 1);
+    queue_push(&sched->injection[group], task);
+    sched_notify(sched);
+}
+
+// Spreads tasks over the groups round robin
+void sched_submit(sched_t* sched, sched_task_t* task) {
+    const u32 group = sched->group_count > 1 ? atomic_fetch_add(&sched->next_group, 1) % sched->group_count : 0;
+    sched_submit_to(sched, group, task);
+}
+
+// Only from a task running on worker_index
+void sched_spawn(sched_t* sched, const u32 worker_index, sched_task_t* task) {
+    atomic_fetch_add(&sched->pending, 1);
+    if (!sched_deque_push(&sched->workers[worker_index], task)) {
+        // Out of deque space, run it right away instead
+        task->run(task, worker_index);
+        sched_finish_task(sched);
+        return;
+    }
+    sched_notify(sched);
+}
+
+// Limits the workers running tasks to the first count, from any thread
+void sched_set_active(sched_t* sched, const u32 count) {
+    assert(count > 0 && count <= sched->worker_count);
+
+    atomic_store(&sched->active, count);
+    sched_notify(sched);
+}
+
+// No more sched_submit() calls after this, tasks may still spawn
+void sched_close(sched_t* sched) {
+    atomic_store(&sched->closed, true);
+    if (atomic_load(&sched->pending) == 0) {
+        atomic_store(&sched->done, true);
+        sched_notify(sched);
+    }
+}
+
+void sched_join(sched_t* sched) {
+    for (u32 i = 0; i < sched->worker_count; i++) {
+        pthread_join(sched->workers[i].thread, NULL);
+    }
+}
+
+void sched_delete(sched_t* sched) {
+    for (u32 i = 0; i < sched->worker_count; i++) {
+        if (arena_valid(&sched->workers[i].arena)) {
+            arena_delete(&sched->workers[i].arena);
+        }
+    }
+    pthread_mutex_destroy(&sched->mutex);
+    pthread_cond_destroy(&sched->cond);
+}
+
+#endif
@@ -0,0 +1,121 @@
+#pragma once
+
+#ifdef TOPO_IMPLEMENTATION
+#ifndef CORE_IMPLEMENTATION
+#define CORE_IMPLEMENTATION
+#endif
+#endif
+#include "core.h"
+
+#include <sched.h>
+
+// CPU topology from /sys/devices/system/cpu: which CPUs the process may run on and how they map to physical cores.
+// Every core is represented by its lowest allowed CPU, the primary, the other hardware threads of a core are its SMT siblings.
+
+typedef struct {
+    cpu_set_t allowed;   // Process affinity
+    cpu_set_t primaries; // One CPU per physical core
+    u32 core_count;
+} topo_t;
+
+bool topo_read_cpu_list(const c* path, cpu_set_t* set);
+bool topo_discover(topo_t* topo);
+u32 topo_order(const topo_t* topo, const cpu_set_t* within, u32* cpus);
+
+#ifdef TOPO_IMPLEMENTATION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Parses a sysfs list like "0-3,8,10-11" into set, returns false on malformed input
+static bool topo_parse_cpu_list(const c* text, cpu_set_t* set) {
+    CPU_ZERO(set);
+    const c* p = text;
+    while (*p && *p != '\n') {
+        c* end;
+        const unsigned long first = strtoul(p, &end, 10);
+        if (end == p) {
+            return false;
+        }
+        unsigned long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtoul(p + 1, &end, 10);
+            if (end == p + 1) {
+                return false;
+            }
+            p = end;
+        }
+        for (unsigned long i = first; i <= last && i < CPU_SETSIZE; i++) {
+            CPU_SET(i, set);
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return true;
+}
+
+// Reads a sysfs CPU (or node) list file
+bool topo_read_cpu_list(const c* path, cpu_set_t* set) {
+    FILE* file = fopen(path, "re");
+    if (!file) {
+        return false;
+    }
+    c line[4096];
+    const bool ok = fgets(line, sizeof(line), file) && topo_parse_cpu_list(line, set);
+    fclose(file);
+    return ok;
+}
+
+// Returns false if the affinity can't be read. A CPU without readable topology counts as a core of its own
+bool topo_discover(topo_t* topo) {
+    assert(topo);
+
+    memset(topo, 0, sizeof(topo_t));
+    if (sched_getaffinity(0, sizeof(topo->allowed), &topo->allowed) != 0) {
+        return false;
+    }
+
+    cpu_set_t seen;
+    CPU_ZERO(&seen);
+    for (u32 cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &topo->allowed) || CPU_ISSET(cpu, &seen)) {
+            continue;
+        }
+
+        // CPUs are visited in ascending order, so the first one of a core is its lowest
+        c path[96];
+        cpu_set_t siblings;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", cpu);
+        if (!topo_read_cpu_list(path, &siblings)) {
+            CPU_ZERO(&siblings);
+        }
+        CPU_SET(cpu, &siblings);
+        CPU_OR(&seen, &seen, &siblings);
+
+        CPU_SET(cpu, &topo->primaries);
+        topo->core_count++;
+    }
+    return topo->core_count > 0;
+}
+
+// Fills cpus with the allowed CPUs in within, one per core first and SMT siblings after, returns their count.
+// cpus must hold CPU_SETSIZE entries
+u32 topo_order(const topo_t* topo, const cpu_set_t* within, u32* cpus) {
+    u32 count = 0;
+    for (u32 cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, within) && CPU_ISSET(cpu, &topo->primaries)) {
+            cpus[count++] = cpu;
+        }
+    }
+    for (u32 cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, within) && CPU_ISSET(cpu, &topo->allowed) && !CPU_ISSET(cpu, &topo->primaries)) {
+            cpus[count++] = cpu;
+        }
+    }
+    return count;
+}
+
+#endif
@@ -0,0 +1,232 @@
+#pragma once
+
+#ifdef URING_IMPLEMENTATION
+#ifndef CORE_IMPLEMENTATION
+#define CORE_IMPLEMENTATION
+#endif
+#endif
+#include "core.h"
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+// Minimal io_uring wrapper on raw syscalls, no liburing dependency.
+// A ring is meant to be driven by a single thread.
+
+typedef struct {
+    i32 fd;
+    u32 features;
+
+    u32* sq_head;
+    u32* sq_tail;
+    u32* sq_mask;
+    u32* sq_entries;
+    u32* sq_array;
+    struct io_uring_sqe* sqes;
+    u32 sq_local_tail;
+    u32 sq_submitted_tail;
+
+    u32* cq_head;
+    u32* cq_tail;
+    u32* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    u64 sq_ring_size;
+    void* cq_ring;
+    u64 cq_ring_size;
+    u64 sqes_size;
+} uring_t;
+
+bool uring_init(uring_t* ring, u32 entries);
+void uring_exit(uring_t* ring);
+bool uring_supports(const uring_t* ring, const u8* opcodes, u32 count);
+bool uring_register_buffers(uring_t* ring, const struct iovec* buffers, u32 count);
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+i32 uring_submit(uring_t* ring, u32 wait_count);
+u32 uring_discard_unsubmitted(uring_t* ring);
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring);
+void uring_cqe_seen(uring_t* ring);
+
+#ifdef URING_IMPLEMENTATION
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static inline u32 uring_load_acquire(const u32* p) {
+    return atomic_load_explicit((const _Atomic u32*)p, memory_order_acquire);
+}
+
+static inline void uring_store_release(u32* p, const u32 value) {
+    atomic_store_explicit((_Atomic u32*)p, value, memory_order_release);
+}
+
+bool uring_init(uring_t* ring, const u32 entries) {
+    assert(ring);
+    assert(is_power_of_two(entries));
+
+    memset(ring, 0, sizeof(uring_t));
+    ring->fd = -1;
+
+    struct io_uring_params params = { 0 };
+    const i32 fd = syscall(SYS_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return false;
+    }
+
+    ring->fd = fd;
+    ring->features = params.features;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = ring->cq_ring_size = ring->sq_ring_size > ring->cq_ring_size ? ring->sq_ring_size : ring->cq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_exit(ring);
+        return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            uring_exit(ring);
+            return false;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_exit(ring);
+        return false;
+    }
+
+    u8* sq = ring->sq_ring;
+    ring->sq_head = (u32*)(sq + params.sq_off.head);
+    ring->sq_tail = (u32*)(sq + params.sq_off.tail);
+    ring->sq_mask = (u32*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = (u32*)(sq + params.sq_off.ring_entries);
+    ring->sq_array = (u32*)(sq + params.sq_off.array);
+    ring->sq_local_tail = ring->sq_submitted_tail = *ring->sq_tail;
+
+    u8* cq = ring->cq_ring;
+    ring->cq_head = (u32*)(cq + params.cq_off.head);
+    ring->cq_tail = (u32*)(cq + params.cq_off.tail);
+    ring->cq_mask = (u32*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+void uring_exit(uring_t* ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(uring_t));
+    ring->fd = -1;
+}
+
+bool uring_supports(const uring_t* ring, const u8* opcodes, const u32 count) {
+    u8 probe_buffer[sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)] = { 0 };
+    struct io_uring_probe* probe = (struct io_uring_probe*)probe_buffer;
+
+    if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        return false;
+    }
+
+    for (u32 i = 0; i < count; i++) {
+        if (opcodes[i] > probe->last_op || !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Pins buffers for IORING_OP_READ_FIXED/WRITE_FIXED, which refer to them by index in buf_index.
+// Kernels before 5.12 charge them against RLIMIT_MEMLOCK, so this can fail where plain reads work
+bool uring_register_buffers(uring_t* ring, const struct iovec* buffers, const u32 count) {
+    return syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+}
+
+// Returns a zeroed SQE, or NULL if the submission queue is full
+struct io_uring_sqe* uring_get_sqe(uring_t* ring) {
+    const u32 head = uring_load_acquire(ring->sq_head);
+    if (ring->sq_local_tail - head >= *ring->sq_entries) {
+        return NULL;
+    }
+
+    const u32 index = ring->sq_local_tail & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+// Submits queued SQEs and waits for at least wait_count completions.
+// Returns the number of submitted SQEs or -errno
+i32 uring_submit(uring_t* ring, const u32 wait_count) {
+    const u32 to_submit = ring->sq_local_tail - ring->sq_submitted_tail;
+    uring_store_release(ring->sq_tail, ring->sq_local_tail);
+
+    if (to_submit == 0 && wait_count == 0) {
+        return 0;
+    }
+
+    const u32 flags = wait_count > 0 ? IORING_ENTER_GETEVENTS : 0;
+    long result;
+    do {
+        result = syscall(SYS_io_uring_enter, ring->fd, to_submit, wait_count, flags, NULL, 0);
+    } while (result < 0 && errno == EINTR);
+
+    if (result < 0) {
+        return -errno;
+    }
+
+    ring->sq_submitted_tail += result;
+    return result;
+}
+
+// Takes back the SQEs queued since the last successful submission, after uring_submit() failed. Returns how many.
+// A failed io_uring_enter consumed none of them, and without SQPOLL the kernel doesn't look at the ring otherwise
+u32 uring_discard_unsubmitted(uring_t* ring) {
+    const u32 count = ring->sq_local_tail - ring->sq_submitted_tail;
+    ring->sq_local_tail = ring->sq_submitted_tail;
+    uring_store_release(ring->sq_tail, ring->sq_local_tail);
+    return count;
+}
+
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring) {
+    const u32 head = *ring->cq_head;
+    if (head == uring_load_acquire(ring->cq_tail)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t* ring) {
+    uring_store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+#endif
@@ -0,0 +1,378 @@
+#pragma once
+
+#ifdef WALK_IMPLEMENTATION
+#ifndef STRING_IMPLEMENTATION
+#define STRING_IMPLEMENTATION
+#endif
+#endif
+#include "string.h"
+
+#ifdef WALK_IMPLEMENTATION
+#ifndef DIR_IMPLEMENTATION
+#define DIR_IMPLEMENTATION
+#endif
+#endif
+#include "dir.h"
+
+#include <pthread.h>
+
+// Parallel directory walker working relative to directory fds.
+// Walk threads pull directories from a shared LIFO stack and push subdirectories back onto it,
+// so a directory costs one path resolution and its entries cost none.
+// Each thread reads directories with getdents64() into its own dir_buffer_size buffer.
+// Regular files and directories are recognized from d_type alone, fstatat() is only issued
+// for entries the filesystem can't type (DT_UNKNOWN) and for symlinks.
+// Symlinks to regular files are reported, symlinks to directories are not followed.
+// Files are reported in batches of up to WALK_BATCH_SIZE entries sharing one directory fd.
+
+#define WALK_BATCH_SIZE 256
+
+typedef struct {
+    str_t path;     // Full path, NUL-terminated, lives in arena until walk_delete()
+    const c* name;  // Entry name relative to dir_fd, points into path
+    i32 dir_fd;     // Only valid during the callback
+    u32 thread_index;
+    u64 ino;
+    u8 type;        // DT_REG
+    arena_t* arena; // Arena of the reporting walk thread, lives until walk_delete()
+} walk_entry_t;
+
+// Called from walk threads, concurrently
+typedef void (*walk_file_fn)(void* user, const walk_entry_t* files, u64 count);
+// Called once, from the last walk thread to finish
+typedef void (*walk_done_fn)(void* user);
+
+typedef struct walk_dir_t walk_dir_t;
+struct walk_dir_t {
+    walk_dir_t* next;
+    str_t path;
+    bool is_root; // Roots may be regular files and get stat()'ed
+};
+
+typedef struct walk_t walk_t;
+
+typedef struct {
+    walk_t* walk;
+    pthread_t thread;
+    arena_t arena;
+    str_t path;
+    dir_reader_t reader;
+    walk_entry_t* batch;
+    u64 batch_count;
+    u32 index;
+} walk_thread_t;
+
+struct walk_t {
+    walk_file_fn on_file;
+    walk_done_fn on_done;
+    void* user;
+
+    walk_thread_t* threads;
+    u32 thread_count;
+    u64 dir_buffer_size;
+    a_u32 running;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    walk_dir_t* stack;
+    u64 pending; // Directories on the stack or being read
+    bool closed; // Threads stop at their next directory, set when walk_start() fails
+};
+
+walk_t* walk_make(arena_t* arena, u32 thread_count, u64 dir_buffer_size, walk_file_fn on_file, walk_done_fn on_done, void* user);
+bool walk_add_root(walk_t* walk, arena_t* arena, str_t root);
+bool walk_start(walk_t* walk);
+void walk_join(walk_t* walk);
+void walk_delete(walk_t* walk);
+
+#ifdef WALK_IMPLEMENTATION
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WALK_PATH_CAPACITY KB(32)
+#define WALK_THREAD_ARENA_SIZE GB(1)
+
+walk_t* walk_make(arena_t* arena, const u32 thread_count, const u64 dir_buffer_size, const walk_file_fn on_file, const walk_done_fn on_done, void* user) {
+    assert(arena_valid(arena));
+    assert(thread_count > 0);
+    assert(on_file);
+
+    walk_t* walk = arena_alloc(arena, sizeof(walk_t));
+    walk_thread_t* threads = arena_alloc(arena, sizeof(walk_thread_t) * thread_count);
+    if (!walk || !threads) {
+        return NULL;
+    }
+
+    *walk = (walk_t){
+        .on_file = on_file,
+        .on_done = on_done,
+        .user = user,
+        .threads = threads,
+        .thread_count = thread_count,
+        .dir_buffer_size = dir_buffer_size
+    };
+    pthread_mutex_init(&walk->mutex, NULL);
+    pthread_cond_init(&walk->cond, NULL);
+
+    for (u32 i = 0; i < thread_count; i++) {
+        threads[i] = (walk_thread_t){ .walk = walk, .index = i };
+    }
+
+    return walk;
+}
+
+static void walk_push(walk_t* walk, walk_dir_t* dir) {
+    pthread_mutex_lock(&walk->mutex);
+    dir->next = walk->stack;
+    walk->stack = dir;
+    walk->pending++;
+    pthread_cond_signal(&walk->cond);
+    pthread_mutex_unlock(&walk->mutex);
+}
+
+bool walk_add_root(walk_t* walk, arena_t* arena, const str_t root) {
+    assert(str_valid(&root));
+
+    walk_dir_t* dir = arena_alloc(arena, sizeof(walk_dir_t));
+    if (!dir) {
+        return false;
+    }
+    *dir = (walk_dir_t){ .path = root, .is_root = true };
+    walk_push(walk, dir);
+    return true;
+}
+
+static u8 walk_type_from_mode(const mode_t mode) {
+    if (S_ISREG(mode)) {
+        return DT_REG;
+    }
+    if (S_ISDIR(mode)) {
+        return DT_DIR;
+    }
+    return DT_UNKNOWN;
+}
+
+// The copy is NUL-terminated past its length
+static str_t walk_copy_path(walk_thread_t* thread) {
+    str_t copy = str_from_size(&thread->arena, thread->path.length + 1);
+    if (str_valid(&copy)) {
+        str_copy(&copy, thread->path);
+        copy.start[copy.length] = '\0';
+        copy.capacity = copy.length;
+    }
+    return copy;
+}
+
+static void walk_flush_files(walk_thread_t* thread) {
+    if (thread->batch_count > 0) {
+        thread->walk->on_file(thread->walk->user, thread->batch, thread->batch_count);
+        thread->batch_count = 0;
+    }
+}
+
+static void walk_add_file(walk_thread_t* thread, const i32 dir_fd, const fu32 name_offset, const u64 ino) {
+    const str_t path = walk_copy_path(thread);
+    if (!str_valid(&path)) {
+        printf("Walk arena is full, skipping: %.*s\n", (int)thread->path.length, thread->path.start);
+        return;
+    }
+
+    thread->batch[thread->batch_count++] = (walk_entry_t){
+        .path = path,
+        .name = path.start + name_offset,
+        .dir_fd = dir_fd,
+        .thread_index = thread->index,
+        .ino = ino,
+        .type = DT_REG,
+        .arena = &thread->arena
+    };
+
+    if (thread->batch_count == WALK_BATCH_SIZE) {
+        walk_flush_files(thread);
+    }
+}
+
+// Takes ownership of dir_fd
+static void walk_read_dir(walk_thread_t* thread, const i32 dir_fd) {
+    str_t* path = &thread->path;
+    dir_reader_t* reader = &thread->reader;
+    const fu32 path_length = path->length;
+
+    dir_reader_open(reader, dir_fd);
+
+    dir_entry_t entry;
+    while (dir_next(reader, &entry)) {
+        if (entry.name.start[0] == '.')
+            continue;
+
+        if (path_length + 1 + entry.name.length >= path->capacity) {
+            printf("Path is too long: %.*s/%s\n", (int)path_length, path->start, entry.name.start);
+            continue;
+        }
+
+        path->start[path_length] = '/';
+        memcpy(path->start + path_length + 1, entry.name.start, entry.name.length);
+        path->length = path_length + 1 + entry.name.length;
+
+        u8 type = entry.type;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            struct stat entry_stat;
+            if (fstatat(dir_fd, entry.name.start, &entry_stat, 0) != 0) {
+                printf("Failed to get stats for path: %.*s\n", (int)path->length, path->start);
+                path->length = path_length;
+                continue;
+            }
+            const u8 target_type = walk_type_from_mode(entry_stat.st_mode);
+            type = (type == DT_LNK && target_type == DT_DIR) ? DT_LNK : target_type;
+        }
+
+        if (type == DT_DIR) {
+            walk_dir_t* child = arena_alloc(&thread->arena, sizeof(walk_dir_t));
+            const str_t child_path = walk_copy_path(thread);
+            if (!child || !str_valid(&child_path)) {
+                printf("Walk arena is full, skipping: %.*s\n", (int)path->length, path->start);
+            } else {
+                *child = (walk_dir_t){ .path = child_path };
+                walk_push(thread->walk, child);
+            }
+        } else if (type == DT_REG) {
+            walk_add_file(thread, dir_fd, path_length + 1, entry.ino);
+        }
+
+        path->length = path_length;
+    }
+
+    walk_flush_files(thread);
+
+    path->length = path_length;
+    if (reader->error != 0) {
+        path->start[path_length] = '\0';
+        printf("Failed to read directory: %s\n", path->start);
+    }
+
+    close(dir_fd);
+}
+
+static void walk_process(walk_thread_t* thread, const walk_dir_t* dir) {
+    str_t* path = &thread->path;
+    if (dir->path.length >= path->capacity) {
+        printf("Path is too long: %.*s\n", (int)dir->path.length, dir->path.start);
+        return;
+    }
+    str_copy(path, dir->path);
+    path->start[path->length] = '\0';
+
+    if (dir->is_root) {
+        struct stat root_stat;
+        if (stat(path->start, &root_stat) != 0) {
+            printf("Failed to get stats for path: %s\n", path->start);
+            return;
+        }
+        if (S_ISREG(root_stat.st_mode)) {
+            walk_add_file(thread, AT_FDCWD, 0, root_stat.st_ino);
+            walk_flush_files(thread);
+            return;
+        }
+        if (!S_ISDIR(root_stat.st_mode)) {
+            return;
+        }
+    }
+
+    const i32 dir_fd = open(path->start, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir_fd == -1) {
+        printf("Failed to open directory: %s\n", path->start);
+        return;
+    }
+    walk_read_dir(thread, dir_fd);
+}
+
+static void* walk_thread_main(void* arg) {
+    walk_thread_t* thread = arg;
+    walk_t* walk = thread->walk;
+
+    pthread_mutex_lock(&walk->mutex);
+    while (true) {
+        while (!walk->closed && !walk->stack && walk->pending > 0) {
+            pthread_cond_wait(&walk->cond, &walk->mutex);
+        }
+        if (walk->closed || !walk->stack) {
+            break;
+        }
+
+        walk_dir_t* dir = walk->stack;
+        walk->stack = dir->next;
+        pthread_mutex_unlock(&walk->mutex);
+
+        walk_process(thread, dir);
+
+        pthread_mutex_lock(&walk->mutex);
+        walk->pending--;
+        if (walk->pending == 0) {
+            pthread_cond_broadcast(&walk->cond);
+        }
+    }
+    pthread_mutex_unlock(&walk->mutex);
+
+    if (atomic_fetch_sub(&walk->running, 1) == 1 && walk->on_done) {
+        walk->on_done(walk->user);
+    }
+
+    return NULL;
+}
+
+// Stops and joins the first started_count threads. running never gets to 0, so on_done isn't called
+static void walk_abort(walk_t* walk, const u32 started_count) {
+    pthread_mutex_lock(&walk->mutex);
+    walk->closed = true;
+    pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->mutex);
+
+    for (u32 i = 0; i < started_count; i++) {
+        pthread_join(walk->threads[i].thread, NULL);
+    }
+}
+
+// On failure no walk thread is left running, the walk may be deleted but not joined
+bool walk_start(walk_t* walk) {
+    assert(walk);
+
+    atomic_store(&walk->running, walk->thread_count);
+
+    for (u32 i = 0; i < walk->thread_count; i++) {
+        walk_thread_t* thread = &walk->threads[i];
+        thread->arena = arena_make(WALK_THREAD_ARENA_SIZE);
+        bool ok = arena_valid(&thread->arena);
+        if (ok) {
+            thread->path = str_from_size(&thread->arena, WALK_PATH_CAPACITY);
+            thread->batch = arena_alloc(&thread->arena, sizeof(walk_entry_t) * WALK_BATCH_SIZE);
+            ok = thread->batch && dir_reader_init(&thread->reader, &thread->arena, walk->dir_buffer_size) &&
+                 pthread_create(&thread->thread, NULL, walk_thread_main, thread) == 0;
+        }
+        if (!ok) {
+            walk_abort(walk, i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void walk_join(walk_t* walk) {
+    for (u32 i = 0; i < walk->thread_count; i++) {
+        pthread_join(walk->threads[i].thread, NULL);
+    }
+}
+
+void walk_delete(walk_t* walk) {
+    for (u32 i = 0; i < walk->thread_count; i++) {
+        if (arena_valid(&walk->threads[i].arena)) {
+            arena_delete(&walk->threads[i].arena);
+        }
+    }
+}
+
+#endif
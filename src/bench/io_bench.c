@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ARENA_IMPLEMENTATION
+#include "../base/arena.h"
+
+// Compares the ways audio-analyzer can read sample data (--io=mmap|populate|pread|direct) on a set of files,
+// each with a cold page cache (every file dropped with POSIX_FADV_DONTNEED first) and a warm one.
+// Every byte is read into a checksum, which stands in for decoding. Dropping clean pages needs no privileges,
+// but pages mapped or dirtied elsewhere stay cached, so cold numbers are only as cold as the system allows.
+//
+// Usage: io-bench [--runs=N] <file or directory>...
+
+#define BENCH_BLOCK_SIZE MB(1)
+#define BENCH_ALIGNMENT 4096
+#define BENCH_MAX_FILES (1 << 20)
+
+typedef enum {
+    BENCH_MMAP,
+    BENCH_POPULATE,
+    BENCH_PREAD,
+    BENCH_DIRECT,
+    BENCH_MODE_COUNT
+} bench_mode_t;
+
+static const c* bench_mode_names[BENCH_MODE_COUNT] = { "mmap", "populate", "pread", "direct" };
+
+typedef struct {
+    c** paths;
+    u64* sizes;
+    u64 count;
+    u64 total_size;
+} bench_files_t;
+
+static bench_files_t bench_files;
+static arena_t bench_arena;
+static bool bench_direct_buffered; // The filesystem refused O_DIRECT (tmpfs does), direct fell back to buffered reads
+
+static u64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int bench_add_file(const char* path, const struct stat* sb, const int type, struct FTW* ftw) {
+    if (type != FTW_F || sb->st_size == 0 || bench_files.count == BENCH_MAX_FILES) {
+        return 0;
+    }
+    const size_t length = strlen(path);
+    c* copy = arena_alloc(&bench_arena, length + 1);
+    memcpy(copy, path, length + 1);
+    bench_files.paths[bench_files.count] = copy;
+    bench_files.sizes[bench_files.count] = sb->st_size;
+    bench_files.count++;
+    bench_files.total_size += sb->st_size;
+    return 0;
+}
+
+static u64 bench_checksum(const u8* data, const u64 size) {
+    u64 sum = 0;
+    u64 i = 0;
+    for (; i + sizeof(u64) <= size; i += sizeof(u64)) {
+        u64 word;
+        memcpy(&word, data + i, sizeof(word));
+        sum += word;
+    }
+    for (; i < size; i++) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+static u64 bench_map(const i32 fd, const u64 size, const bool populate) {
+    u8* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    const u64 sum = bench_checksum(map, size);
+    munmap(map, size);
+    return sum;
+}
+
+// Aligned blocks like the analyzer's, the tail of the last block is whatever the file has left
+static u64 bench_read(const i32 fd, const u64 size, u8* buffer) {
+    u64 sum = 0;
+    for (u64 offset = 0; offset < size; offset += BENCH_BLOCK_SIZE) {
+        const ssize_t result = pread(fd, buffer, BENCH_BLOCK_SIZE, offset);
+        if (result <= 0) {
+            break;
+        }
+        sum += bench_checksum(buffer, result);
+    }
+    return sum;
+}
+
+static u64 bench_file(const u64 index, const bench_mode_t mode, u8* buffer) {
+    i32 fd = open(bench_files.paths[index], O_RDONLY | O_CLOEXEC | (mode == BENCH_DIRECT ? O_DIRECT : 0));
+    if (fd == -1 && mode == BENCH_DIRECT && errno == EINVAL) {
+        bench_direct_buffered = true;
+        fd = open(bench_files.paths[index], O_RDONLY | O_CLOEXEC);
+    }
+    if (fd == -1) {
+        printf("Failed to open %s: %s\n", bench_files.paths[index], strerror(errno));
+        exit(1);
+    }
+
+    u64 sum = 0;
+    switch (mode) {
+    case BENCH_MMAP:
+    case BENCH_POPULATE:
+        sum = bench_map(fd, bench_files.sizes[index], mode == BENCH_POPULATE);
+        break;
+    case BENCH_PREAD:
+    case BENCH_DIRECT:
+        sum = bench_read(fd, bench_files.sizes[index], buffer);
+        break;
+    default:
+        break;
+    }
+    close(fd);
+    return sum;
+}
+
+static void bench_drop_cache(void) {
+    for (u64 i = 0; i < bench_files.count; i++) {
+        const i32 fd = open(bench_files.paths[i], O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+}
+
+static u64 bench_run(const bench_mode_t mode, const bool cold, u8* buffer, u64* checksum) {
+    if (cold) {
+        bench_drop_cache();
+    } else {
+        for (u64 i = 0; i < bench_files.count; i++) {
+            bench_file(i, BENCH_PREAD, buffer);
+        }
+    }
+
+    const u64 start = now_ns();
+    for (u64 i = 0; i < bench_files.count; i++) {
+        *checksum += bench_file(i, mode, buffer);
+    }
+    return now_ns() - start;
+}
+
+int main(const int argc, char* argv[]) {
+    u64 runs = 3;
+
+    bench_arena = arena_make(GB(1));
+    bench_files.paths = arena_alloc(&bench_arena, sizeof(c*) * BENCH_MAX_FILES);
+    bench_files.sizes = arena_alloc(&bench_arena, sizeof(u64) * BENCH_MAX_FILES);
+    u8* buffer = arena_alloc_aligned(&bench_arena, BENCH_BLOCK_SIZE, BENCH_ALIGNMENT);
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--runs=", 7) == 0) {
+            runs = strtoull(argv[i] + 7, NULL, 10);
+            runs = runs > 0 ? runs : 1;
+        } else if (nftw(argv[i], bench_add_file, 64, FTW_PHYS) != 0) {
+            printf("Failed to read %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (bench_files.count == 0) {
+        printf("Usage: %s [--runs=N] <file or directory>...\n", argv[0]);
+        return 1;
+    }
+
+    printf("%lu files, %.1f MB, best of %lu runs\n", bench_files.count, (f64)bench_files.total_size / MB(1), runs);
+    printf("%10s %6s %12s %12s\n", "io", "cache", "MB/s", "files/s");
+
+    u64 expected = 0;
+    for (u32 pass = 0; pass < 2; pass++) {
+        const bool cold = pass == 0;
+        for (bench_mode_t mode = 0; mode < BENCH_MODE_COUNT; mode++) {
+            u64 best = UINT64_MAX;
+            for (u64 run = 0; run < runs; run++) {
+                u64 checksum = 0;
+                const u64 elapsed = bench_run(mode, cold, buffer, &checksum);
+                best = elapsed < best ? elapsed : best;
+
+                // Every mode has to see the same bytes
+                if (expected == 0) {
+                    expected = checksum;
+                } else if (checksum != expected) {
+                    printf("%s read different data\n", bench_mode_names[mode]);
+                    return 1;
+                }
+            }
+            const f64 seconds = best / 1e9;
+            const c* name = mode == BENCH_DIRECT && bench_direct_buffered ? "direct*" : bench_mode_names[mode];
+            printf("%10s %6s %12.1f %12.1f\n", name, cold ? "cold" : "warm", bench_files.total_size / seconds / MB(1), bench_files.count / seconds);
+        }
+    }
+    if (bench_direct_buffered) {
+        printf("* O_DIRECT isn't supported for some of the files, those were read buffered like with pread\n");
+    }
+
+    arena_delete(&bench_arena);
+    return 0;
+}
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ARENA_IMPLEMENTATION
+#include "../base/arena.h"
+
+#define SCHED_IMPLEMENTATION
+#include "../base/sched.h"
+
+// Scaling benchmark for the work-stealing scheduler against a plain shared queue.
+// The workload mimics our file size distribution: mostly tiny files, a few huge ones.
+// A task costs its size in work units; tasks above the split threshold are cut into chunks,
+// spawned from inside the task on the work-stealing side and queued up front on the shared queue side.
+//
+// Usage: sched-bench [--tasks=N] [--max-threads=N] [--seed=N]
+
+#define BENCH_SPLIT_UNITS 4096
+#define BENCH_QUEUE_CAPACITY 4096
+
+typedef struct bench_task_t bench_task_t;
+struct bench_task_t {
+    sched_task_t task; // First, so the scheduler's task pointer is the bench task
+    u64 units;
+    sched_t* sched;
+    bench_task_t* chunks; // Freed once the scheduler is joined
+};
+
+static a_u64 bench_sink;
+
+static u64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Stands in for decoding and measuring samples, roughly 1ns per unit on a current core
+static void bench_work(const u64 units) {
+    u64 x = units | 1;
+    for (u64 i = 0; i < units * 4; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+    }
+    atomic_fetch_add_explicit(&bench_sink, x, memory_order_relaxed);
+}
+
+static u64 bench_random(u64* state) {
+    u64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// 90% tiny, 9% medium, 1% huge, with the huge ones carrying most of the total work
+static u64* bench_make_sizes(arena_t* arena, const u64 count, u64 seed) {
+    u64* sizes = arena_alloc(arena, sizeof(u64) * count);
+    for (u64 i = 0; i < count; i++) {
+        const u64 roll = bench_random(&seed) % 1000;
+        if (roll < 900) {
+            sizes[i] = 16 + bench_random(&seed) % 256;
+        } else if (roll < 990) {
+            sizes[i] = 4096 + bench_random(&seed) % 65536;
+        } else {
+            sizes[i] = 100000 + bench_random(&seed) % 400000;
+        }
+    }
+    return sizes;
+}
+
+static void bench_run_chunk(sched_task_t* task, const u32 worker_index) {
+    bench_work(((bench_task_t*)task)->units);
+}
+
+// The file task spawns its chunks and works through them itself unless other workers steal them first
+static void bench_run_file(sched_task_t* task, const u32 worker_index) {
+    bench_task_t* file = (bench_task_t*)task;
+    if (file->units <= BENCH_SPLIT_UNITS) {
+        bench_work(file->units);
+        return;
+    }
+
+    const u64 chunk_count = (file->units + BENCH_SPLIT_UNITS - 1) / BENCH_SPLIT_UNITS;
+    bench_task_t* chunks = malloc(sizeof(bench_task_t) * chunk_count);
+    for (u64 i = 0; i < chunk_count; i++) {
+        const u64 remaining = file->units - i * BENCH_SPLIT_UNITS;
+        chunks[i] = (bench_task_t){
+            .task = { .run = bench_run_chunk },
+            .units = remaining < BENCH_SPLIT_UNITS ? remaining : BENCH_SPLIT_UNITS
+        };
+        sched_spawn(file->sched, worker_index, &chunks[i].task);
+    }
+    file->chunks = chunks;
+}
+
+static u64 bench_sched(arena_t* arena, const u64* sizes, const u64 count, const u32 threads, u64* steals) {
+    arena_t run_arena = arena_make(MB(64));
+    sched_t* sched = sched_make(&run_arena, threads, 1, BENCH_QUEUE_CAPACITY);
+    bench_task_t* tasks = arena_alloc(arena, sizeof(bench_task_t) * count);
+
+    const u64 start = now_ns();
+    if (!sched || !sched_start(sched, NULL)) {
+        printf("Failed to start the scheduler\n");
+        exit(1);
+    }
+    for (u64 i = 0; i < count; i++) {
+        tasks[i] = (bench_task_t){ .task = { .run = bench_run_file }, .units = sizes[i], .sched = sched };
+        sched_submit(sched, &tasks[i].task);
+    }
+    sched_close(sched);
+    sched_join(sched);
+    const u64 elapsed = now_ns() - start;
+
+    *steals = 0;
+    for (u32 i = 0; i < threads; i++) {
+        *steals += sched->workers[i].stolen;
+    }
+    for (u64 i = 0; i < count; i++) {
+        free(tasks[i].chunks);
+    }
+    sched_delete(sched);
+    arena_delete(&run_arena);
+    return elapsed;
+}
+
+static void* bench_queue_worker(void* arg) {
+    queue_t* queue = arg;
+    void* item;
+    while (queue_pop(queue, &item)) {
+        bench_work((u64)(uptr)item);
+    }
+    return NULL;
+}
+
+static u64 bench_queue(const u64* sizes, const u64 count, const u32 threads) {
+    arena_t run_arena = arena_make(MB(64));
+    queue_t queue;
+    pthread_t workers[threads];
+    if (!queue_init(&queue, &run_arena, BENCH_QUEUE_CAPACITY)) {
+        printf("Failed to allocate the queue\n");
+        exit(1);
+    }
+
+    const u64 start = now_ns();
+    for (u32 i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, bench_queue_worker, &queue);
+    }
+    for (u64 i = 0; i < count; i++) {
+        for (u64 offset = 0; offset < sizes[i]; offset += BENCH_SPLIT_UNITS) {
+            const u64 remaining = sizes[i] - offset;
+            queue_push(&queue, (void*)(uptr)(remaining < BENCH_SPLIT_UNITS ? remaining : BENCH_SPLIT_UNITS));
+        }
+    }
+    queue_close(&queue);
+    for (u32 i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    const u64 elapsed = now_ns() - start;
+
+    arena_delete(&run_arena);
+    return elapsed;
+}
+
+static u64 parse_option(const c* arg, const c* name, const u64 fallback) {
+    const size_t length = strlen(name);
+    if (strncmp(arg, name, length) == 0 && arg[length] == '=') {
+        return strtoull(arg + length + 1, NULL, 10);
+    }
+    return fallback;
+}
+
+int main(const int argc, char* argv[]) {
+    u64 task_count = 20000;
+    u64 max_threads = 64;
+    u64 seed = 0x2545F4914F6CDD1Dull;
+    for (int i = 1; i < argc; i++) {
+        task_count = parse_option(argv[i], "--tasks", task_count);
+        max_threads = parse_option(argv[i], "--max-threads", max_threads);
+        seed = parse_option(argv[i], "--seed", seed) | 1;
+    }
+
+    arena_t arena = arena_make(GB(1));
+    const u64* sizes = bench_make_sizes(&arena, task_count, seed);
+
+    u64 total_units = 0;
+    for (u64 i = 0; i < task_count; i++) {
+        total_units += sizes[i];
+    }
+    printf("%lu tasks, %lu work units, split above %u units\n", task_count, total_units, BENCH_SPLIT_UNITS);
+    printf("%8s %14s %14s %10s %10s\n", "threads", "queue ms", "stealing ms", "speedup", "steals");
+
+    u64 base_time = 0;
+    for (u32 threads = 1; threads <= max_threads; threads *= 2) {
+        const u64 queue_time = bench_queue(sizes, task_count, threads);
+        u64 steals;
+        const u64 sched_time = bench_sched(&arena, sizes, task_count, threads, &steals);
+        if (threads == 1) {
+            base_time = sched_time;
+        }
+        printf("%8u %14.1f %14.1f %9.2fx %10lu\n",
+               threads,
+               queue_time / 1e6,
+               sched_time / 1e6,
+               (f64)base_time / sched_time,
+               steals);
+    }
+
+    arena_delete(&arena);
+    return 0;
+}
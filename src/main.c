@@ -1,11 +1,30 @@
+#define _GNU_SOURCE
+
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <math.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <strings.h>
 #include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include <linux/fiemap.h>
+#include <linux/fs.h>
 
 #define STRING_IMPLEMENTATION
 #include "base/string.h"
@@ -13,14 +32,374 @@
 #define ARRAY_IMPLEMENTATION
 #include "base/array.h"
 
-#define NUM_THREADS 6
+#define META_IMPLEMENTATION
+#include "base/meta.h"
+
+#define INODE_SET_IMPLEMENTATION
+#include "base/inode_set.h"
+
+#define FILE_INDEX_IMPLEMENTATION
+#include "base/file_index.h"
+
+#define SCHED_IMPLEMENTATION
+#include "base/sched.h"
+
+#define TOPO_IMPLEMENTATION
+#include "base/topo.h"
+
+#define NUMA_IMPLEMENTATION
+#include "base/numa.h"
+
+#define WALK_IMPLEMENTATION
+#include "base/walk.h"
+
+#define FILE_QUEUE_CAPACITY 4096
+
+#define RESERVED_FDS 256
+
+// Bump whenever file_result_t changes, so existing indexes get rebuilt
+#define RESULT_VERSION 2
+
+#define WAVE_FORMAT_PCM 1
+#define WAVE_FORMAT_IEEE_FLOAT 3
+#define WAVE_FORMAT_EXTENSIBLE 65534
+
+// High-passed peak: one-pole DC blocker, ranges after the first start it HP_SETTLE_LEVEL worth of decay early
+#define HP_CUTOFF_HZ 20.0
+#define HP_SETTLE_LEVEL 1e-6
+
+#define WORKER_SCRATCH_SIZE GB(1)
+
+#define PLANAR_BUFFER_SIZE KB(256)  // Decoded samples of the frames being measured, per worker
+#define MAP_WINDOW_SIZE MB(4)       // Mapped data measured between giving pages back, see measure_mapped()
+#define MAP_RELEASE_ALIGNMENT MB(2) // Page cache can be mapped in huge pages, which madvise() only drops whole
+
+#define IO_BLOCK_SIZE MB(1)
+#define IO_HEADER_SIZE KB(64) // Read first looking for the chunk headers
+#define IO_ALIGNMENT 4096     // Offsets, sizes and buffers for O_DIRECT
+
+#define PROBE_READ_SIZE KB(4) // First read of --probe, holds the chunk headers of most files
+#define PROBE_MAX_CHUNKS 256  // Listed per file, keeps a probe line well within an output buffer
+
+#define PREFETCH_QUEUE_CAPACITY 4096
+#define PREFETCH_MAX_CHUNKS 64 // Chunk headers followed looking for "data" before prefetching the whole file
+
+#define SPLIT_MIN_RANGE_SIZE MB(8)
+#define SPLIT_RANGES_PER_THREAD 4
+
+#define ADAPT_INTERVAL_MS 250
+#define ADAPT_SETTLE_INTERVALS 4 // Intervals without a change before the controller probes again
+#define ADAPT_TOLERANCE 0.05     // Throughput changes within this fraction count as noise
+#define ADAPT_IO_BOUND_CPU 0.5   // CPU use of the active workers below which they're mostly waiting on I/O
+#define ADAPT_UPWARD_PROBES 4    // Every this many probes goes towards more workers even when they're busy
+
+#define OUTPUT_BUFFER_SIZE KB(64)
+#define OUTPUT_BUFFERS_PER_THREAD 4
+#define OUTPUT_BATCH 64 // Buffers written per writev()
+#define OUTPUT_STDIO UINT32_MAX // Worker index for output_printf() from threads that aren't workers
+
+#define FILE_LIST_BUFFER_SIZE MB(1)
+#define FILE_LIST_ARENA_SIZE GB(1)
+
+#define WATCH_ARENA_SIZE GB(4)        // Directory paths, kept while they're watched
+#define WATCH_BATCH_ARENA_SIZE MB(2)   // WALK_BATCH_SIZE file paths of up to PATH_MAX + NAME_MAX and their jobs
+#define WATCH_EVENT_BUFFER_SIZE KB(256)
+#define WATCH_DIR_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+typedef enum {
+    ORDER_DISCOVERY,
+    ORDER_PHYSICAL, // First extent from FIEMAP, inode number where that's unsupported
+    ORDER_INODE,
+    ORDER_SIZE // Largest first
+} order_t;
+
+typedef enum {
+    IO_MMAP,
+    IO_POPULATE, // mmap() with MAP_POPULATE
+    IO_PREAD,
+    IO_DIRECT, // pread() with O_DIRECT
+    IO_URING   // Reader threads with io_uring and O_DIRECT, see reader_t
+} io_mode_t;
+
+typedef enum {
+    PINNING_CORES,   // A worker per physical core, helpers on the CPUs left over
+    PINNING_THREADS, // A worker per hardware thread
+    PINNING_OFF
+} pinning_t;
+
+typedef struct {
+    u32 threads; // 0 until resolved by default_thread_count()
+    pinning_t pinning;
+    u32 walk_threads;
+    u64 dir_buffer_size;
+    u32 meta_depth;
+    bool use_uring;
+    const c* files_from; // File list path, "-" for stdin
+    order_t order;
+    u32 size_window; // Jobs each source holds back to dispatch largest first, 0 to dispatch as found
+    u64 split_threshold; // Data chunks at least this big are measured on several workers, 0 never splits
+    u64 prefetch_budget; // Bytes of data chunks read ahead of the workers, 0 hands jobs straight to them
+    u64 scratch_limit;   // Scratch memory a worker keeps between files
+    bool numa;           // One worker group per NUMA node
+    bool adaptive;       // Let adapt_thread_main() pick the number of active workers
+    bool probe;          // Only list formats and chunks, see run_probe_job()
+    bool no_cache_pollution; // Drop what was read from the page cache as soon as it's measured
+    io_mode_t io;
+    u32 io_depth;   // Reads in flight per reader thread with --io=uring
+    u32 io_threads; // Reader threads with --io=uring
+    bool dedup;
+    const c* index_path;
+    bool index_compact;
+    bool watch;
+} options_t;
+
+static options_t options = {
+    .walk_threads = 4,
+    .dir_buffer_size = DIR_DEFAULT_BUFFER_SIZE,
+    .meta_depth = 64,
+    .use_uring = true,
+    .dedup = true,
+    .split_threshold = MB(64),
+    .prefetch_budget = MB(256),
+    .scratch_limit = MB(8),
+    .io_depth = 32,
+    .io_threads = 1
+};
+
+typedef struct file_alias_t file_alias_t;
+struct file_alias_t {
+    str_t path;
+    file_alias_t* next;
+};
+
+// Paths and jobs of up to WALK_BATCH_SIZE files from --watch, recycled once every job from it is done
+typedef struct watch_batch_t watch_batch_t;
+struct watch_batch_t {
+    arena_t arena;
+    a_u64 pending;       // Unfinished jobs, plus one while the watcher still fills it
+    watch_batch_t* next; // In a free list
+};
+
+typedef struct file_job_t file_job_t;
+struct file_job_t {
+    sched_task_t task; // First, so the scheduler's task pointer is the job
+    str_t path; // NUL-terminated
+    i32 fd;     // Opened during discovery, or -1 to be opened by open_analysis()
+    u64 size;
+    u64 dev;
+    u64 ino;
+    i64 mtime_ns;
+    u64 order_key; // Only set when options.order isn't ORDER_DISCOVERY
+    file_job_t* next;
+    bool rejected; // Failed the header probe after being registered for de-duplication
+    _Atomic(file_alias_t*) aliases;   // Other paths of the same (dev, ino)
+    file_job_t* next_aliased;         // In aliased_jobs, once the first alias is found
+    u64 prefetched_bytes;             // Charged against the prefetch budget until the job finishes
+    watch_batch_t* watch_batch;       // Holding the job with --watch, NULL otherwise
+};
 
-// TODO: Proper CLI args parsing
-// TODO: For each found file - check if it's a file. If it is - check if it's a .wav file (extension + RIFF), if it is - save its path. If it's a dir - recurse over the directory and do the same.
+// Stored as is in the index, keep it free of pointers
+typedef struct {
+    u32 riff_size;
+    u32 fmt_size;
+    u16 format_type;
+    u16 channels;
+    u32 sample_rate;
+    u32 byterate;
+    u16 block_align;
+    u16 bits_per_sample;
+    u32 data_size;
+    i64 data_size_difference;
+
+    // Sample metrics, all zero if the sample format isn't supported
+    u64 frames;
+    f32 peak;     // Linear, 1.0 is full scale
+    f32 rms;      // Of the loudest channel
+    f32 dc_offset;
+    f32 hp_peak;  // Peak after removing DC and subsonic content
+    u64 clipped_samples;
+} file_result_t;
+
+typedef enum {
+    SAMPLE_UNSUPPORTED,
+    SAMPLE_U8,
+    SAMPLE_I16,
+    SAMPLE_I24,
+    SAMPLE_I32,
+    SAMPLE_F32,
+    SAMPLE_F64
+} sample_format_t;
+
+typedef struct {
+    sample_format_t format;
+    u16 channels;
+    u32 bytes_per_sample;
+    u32 block_align; // Bytes per frame
+    f32 hp_coefficient;
+    u64 hp_warmup_frames;
+} sample_layout_t;
+
+// Partial metric state of one channel over a range of frames
+typedef struct {
+    f32 peak;
+    f32 hp_peak;
+    f64 sum;
+    f64 sum_squares;
+    u64 clipped;
+} channel_metrics_t;
+
+typedef struct {
+    f32 x1;
+    f32 y1;
+} channel_filter_t;
+
+typedef struct file_analysis_t file_analysis_t;
+typedef struct reader_t reader_t;
+
+typedef struct {
+    sched_task_t task; // First, so the scheduler's task pointer is the range
+    file_analysis_t* analysis;
+    u64 first_frame;
+    u64 frame_count;
+    channel_metrics_t* metrics;
+    channel_filter_t* filters;
+    const u8* block;  // With --io=uring, the range's frames from its warm-up on in a reader buffer
+    u32 buffer_index; // Of block, handed back to the reader once measured
+} range_task_t;
+
+// A mapped file being measured, in the worker's scratch arena or, once split, in its own until the last range is merged
+struct file_analysis_t {
+    const file_job_t* job;
+    arena_t own_arena; // Invalid unless split
+    i32 fd;
+    u8* map; // NULL when read with pread()
+    u64 map_size;
+    sample_layout_t layout;
+    const u8* data;   // Samples in the mapping, NULL when read with pread()
+    u64 data_offset;  // Of the samples in the file
+    u64 frame_count;
+    file_result_t result;
+    range_task_t* ranges;
+    u32 range_count;
+    a_u32 remaining_ranges;
+    atomic_bool read_failed; // Set by any range that couldn't read all of its frames, nothing is reported then
+
+    // With --io=uring, only touched by the reader thread
+    reader_t* reader;
+    u32 next_range;                // Next one to read
+    file_analysis_t* next_pending; // In the reader's pending list
+};
+
+// Per-thread state of a file source (a walk thread or the file list reader)
+typedef struct {
+    meta_t meta;
+    meta_op_t* ops;
+    const walk_entry_t** candidates; // Files that passed the extension check, parallel to ops
+    file_job_t** jobs;               // Parallel to ops after de-duplication
+    bool rescan;                     // Files may come back with new contents (watch events), skip de-duplication
+    watch_batch_t* watch_batch;      // Holding the files passed in, with --watch
+    file_job_t* collected;           // Jobs held back for sorting, when options.order isn't ORDER_DISCOVERY
+    u64 collected_count;
+    file_job_t** window;             // Max-heap by size of up to options.size_window jobs
+    u64 window_count;
+} discover_t;
 
 static arena_t arena_global;
 static arena_t arena_temp;
 
+static sched_t* sched;
+
+static discover_t* walk_discoverers;
+
+// File descriptors that may still be held open by queued jobs
+static a_i64 fd_budget;
+
+// Walk, file list and watcher, the file queue is closed when the last one finishes
+static a_u32 active_sources;
+
+static a_u32 analyzed_count;
+static _Atomic(watch_batch_t*) finished_watch_batches; // Handed back by workers for the watcher to reuse
+static a_u64 last_start_ns; // When the last job to start was picked up by a worker
+static a_u64 measured_bytes; // Sample data measured so far, counted per range
+
+// Stage between the sources and the workers that reads data chunks into the page cache ahead of analysis
+typedef struct {
+    pthread_t thread;
+    queue_t queue;
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+    u64 in_flight;  // Bytes prefetched for jobs that haven't finished yet
+    u32 next_group; // Round robin over the worker groups for uncached files with --numa
+} prefetch_t;
+
+static prefetch_t prefetch;
+
+// A block read in flight with --io=uring, one per reader buffer
+typedef struct {
+    file_job_t* job;
+    i32 fd;
+    file_analysis_t* analysis; // NULL while the header is read
+    range_task_t* range;
+    u64 offset; // IO_ALIGNMENT aligned, like size
+    u64 size;
+    u64 needed; // Bytes up to the end of the range, fewer only at the end of the file
+    u64 done;
+    bool reading; // Queued on the ring and not reaped yet
+} reader_block_t;
+
+// The --io=uring read engine. Each reader thread owns a ring and a pool of IO_BLOCK_SIZE buffers registered with it.
+// It keeps up to options.io_depth reads in flight across files and hands every completed block straight to the
+// workers as a range task, which gives the buffer back through returned once it's measured
+struct reader_t {
+    pthread_t thread;
+    uring_t ring;
+    bool fixed; // Buffers registered, reads are IORING_OP_READ_FIXED
+    arena_t arena;
+    u8* buffers;
+    reader_block_t* blocks; // Per buffer
+    u32 buffer_count;
+    u32* free_buffers; // Not in flight and not with a worker
+    u32 free_count;
+    queue_t returned;
+    u32 in_flight;
+    file_analysis_t* pending; // Files with ranges left to read, oldest first
+    file_analysis_t* pending_tail;
+};
+
+typedef struct {
+    queue_t jobs;
+    reader_t* readers;
+    a_u32 running; // The last reader to finish closes the scheduler
+} readers_t;
+
+static readers_t readers;
+
+// Per-file scratch memory of one worker
+typedef struct {
+    arena_t arena;
+    u64 high_water; // Largest position since the pages were last given back
+
+    arena_t buffer_arena; // Holds planar, and read_buffer with --io=pread, --io=direct and --io=uring
+    f32* planar;          // PLANAR_BUFFER_SIZE bytes, see measure_frames()
+    u8* read_buffer;      // IO_BLOCK_SIZE bytes, IO_ALIGNMENT aligned. With --io=uring only for ranges the reader couldn't read
+} worker_scratch_t;
+
+static worker_scratch_t* worker_scratch;
+
+// Nodes the worker groups run on with --numa, group i on numa.nodes[i]
+static numa_t numa;
+
+static topo_t topo;
+
+static a_u64 rejected_by_extension;
+static a_u64 rejected_by_header;
+
+static file_index_t file_index;
+static a_u64 index_hits;
+
+static inode_set_t inode_set;
+static _Atomic(file_job_t*) aliased_jobs;
+
 typedef struct {
     c riff[4];
     u32 overall_size;
@@ -57,275 +436,3094 @@ typedef struct {
     u32 size;
 } wave_generic_chunk_t;
 
-void* process_file(void* arg) {
-    const str_t* file_name = arg;
+typedef struct {
+    u64 length;
+    c data[OUTPUT_BUFFER_SIZE];
+} output_buffer_t;
+
+// Workers format results into buffers of their own and hand full ones to a single writer thread,
+// so they never contend on the stdio lock. Buffers only ever hold whole lines, and the writer
+// holds the stdout lock while it writes, so printf() from other threads can't land in between
+typedef struct {
+    pthread_t thread;
+    queue_t full;
+    queue_t free;
+    output_buffer_t** current; // Per worker, NULL while it has nothing buffered
+} output_t;
+
+static output_t output;
 
-    if (file_name == NULL) {
-        int3();
-        return NULL;
+static void write_all(const i32 fd, struct iovec* iov, u32 count) {
+    while (count > 0) {
+        const ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        u64 remaining = written;
+        while (count > 0 && remaining >= iov->iov_len) {
+            remaining -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (u8*)iov->iov_base + remaining;
+            iov->iov_len -= remaining;
+        }
     }
+}
 
-    arena_t arena_temp_tl = arena_make(MB(8));
+static void* output_thread_main(void* arg) {
+    output_buffer_t* batch[OUTPUT_BATCH];
+    struct iovec iov[OUTPUT_BATCH];
+    while (queue_pop(&output.full, (void**)&batch[0])) {
+        u32 count = 1;
+        while (count < OUTPUT_BATCH && queue_try_pop(&output.full, (void**)&batch[count])) {
+            count++;
+        }
+        for (u32 i = 0; i < count; i++) {
+            iov[i] = (struct iovec){ .iov_base = batch[i]->data, .iov_len = batch[i]->length };
+        }
 
-    const c* file_name_cstr = str_to_cstr(&arena_temp_tl, *file_name);
-    const int fd = open(file_name_cstr, O_RDONLY);
+        flockfile(stdout);
+        fflush_unlocked(stdout);
+        write_all(STDOUT_FILENO, iov, count);
+        funlockfile(stdout);
 
-    if (fd == -1) {
-        int3();
-        return NULL;
+        for (u32 i = 0; i < count; i++) {
+            batch[i]->length = 0;
+            queue_push(&output.free, batch[i]);
+        }
     }
+    return NULL;
+}
 
-    struct stat sb;
-    if (fstat(fd, &sb) == -1) {
-        int3();
-        goto close_file;
+static bool output_start(void) {
+    const u64 buffer_count = (u64)options.threads * OUTPUT_BUFFERS_PER_THREAD;
+    u64 capacity = 2;
+    while (capacity < buffer_count) {
+        capacity *= 2;
     }
 
-    u8* file = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0); // TODO: Benchmark with | MAP_POPULATE
-
-    if (file == MAP_FAILED) {
-        int3();
-        goto close_file;
+    output.current = arena_alloc(&arena_global, sizeof(output_buffer_t*) * options.threads);
+    output_buffer_t* buffers = arena_alloc(&arena_global, sizeof(output_buffer_t) * buffer_count);
+    if (!output.current || !buffers || !queue_init(&output.full, &arena_global, capacity) || !queue_init(&output.free, &arena_global, capacity)) {
+        return false;
     }
+    memset(output.current, 0, sizeof(output_buffer_t*) * options.threads);
+    for (u64 i = 0; i < buffer_count; i++) {
+        buffers[i].length = 0;
+        queue_push(&output.free, &buffers[i]);
+    }
+    return pthread_create(&output.thread, NULL, output_thread_main, NULL) == 0;
+}
 
-    if (sb.st_size < 12) {
-        int3();
-        goto unmap_file;
+// Hands the worker's buffer to the writer, only from the worker itself or once the workers are joined.
+// Also run by workers before they go idle, so results don't sit in a buffer while there's nothing else to do
+static void output_flush(const u32 worker_index) {
+    output_buffer_t* buffer = output.current[worker_index];
+    if (buffer) {
+        output.current[worker_index] = NULL;
+        queue_push(&output.full, buffer);
     }
+}
 
-    wave_riff_header_t riff_header = {};
-    memcpy(&riff_header, file, 12);
+// Appends a formatted line to the worker's buffer, printf() for OUTPUT_STDIO
+static void output_printf(const u32 worker_index, const c* format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (worker_index == OUTPUT_STDIO) {
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
 
-    const u8* fmt_chunk_in_file = file + 12;
-    while (memcmp(fmt_chunk_in_file, "fmt ", 4) != 0) {
-        u32 next_chunk_size;
-        memcpy(&next_chunk_size, fmt_chunk_in_file + 4, sizeof(u32));
-        fmt_chunk_in_file += 8 + next_chunk_size + (next_chunk_size & 1);
-        if (fmt_chunk_in_file > file + sb.st_size - sizeof(wave_fmt_chunk_t)) {
-            printf("Couldn't find fmt string\n");
-            int3();
-            goto unmap_file;
+    for (u32 attempt = 0; attempt < 2; attempt++) {
+        output_buffer_t* buffer = output.current[worker_index];
+        if (!buffer) {
+            queue_pop(&output.free, (void**)&buffer);
+            output.current[worker_index] = buffer;
         }
-    }
 
-    wave_fmt_chunk_t fmt_chunk = {};
-    memcpy(&fmt_chunk, fmt_chunk_in_file, sizeof(wave_fmt_chunk_t));
+        va_list attempt_args;
+        va_copy(attempt_args, args);
+        const i32 length = vsnprintf(buffer->data + buffer->length, OUTPUT_BUFFER_SIZE - buffer->length, format, attempt_args);
+        va_end(attempt_args);
 
-    const u8* data_chunk_in_file = fmt_chunk_in_file + 8 + fmt_chunk.fmt_size + (fmt_chunk.fmt_size & 1);
-    while (memcmp(data_chunk_in_file, "data", 4) != 0) {
-        u32 next_chunk_size;
-        memcpy(&next_chunk_size, data_chunk_in_file + 4, sizeof(u32));
-        data_chunk_in_file += 8 + next_chunk_size + (next_chunk_size & 1);
-        if (data_chunk_in_file > file + sb.st_size - sizeof(wave_generic_chunk_t)) {
-            printf("Couldn't find data string\n");
-            int3();
-            goto unmap_file;
+        if (length >= 0 && (u64)length < OUTPUT_BUFFER_SIZE - buffer->length) {
+            buffer->length += length;
+            va_end(args);
+            return;
         }
+        // Doesn't fit, the partial line is dropped by not advancing the length
+        output_flush(worker_index);
     }
+    va_end(args);
+    int3(); // Longer than a whole buffer
+}
 
-    wave_generic_chunk_t data_chunk = {};
-    memcpy(&data_chunk, data_chunk_in_file, sizeof(wave_generic_chunk_t));
+// After sched_join(), writes out what the workers still hold
+static void output_finish(void) {
+    for (u32 i = 0; i < options.threads; i++) {
+        output_flush(i);
+    }
+    queue_close(&output.full);
+    pthread_join(output.thread, NULL);
+}
 
-    const i64 remaining_size_after_data = (sb.st_size - (data_chunk_in_file + 8 - file)) - data_chunk.size;
+static void print_result(const u32 worker_index, const str_t path, const file_result_t* result) {
+    output_printf(worker_index, "%.*s: RIFF: RIFF, Size: %u, WAVE: WAVE, fmt: fmt , fmt_size: %u, format_type: %u, channels: %u, sample_rate: %u, byterate: %u, block_align: %u, bits_per_sample: %u, data: data, data_size: %u, data_size_difference: %ld, frames: %lu, peak_dbfs: %.2f, rms_dbfs: %.2f, dc_offset: %.6f, hp_peak_dbfs: %.2f, clipped_samples: %lu\n",
+                  (int)path.length,
+                  path.start,
+                  result->riff_size,
+                  result->fmt_size,
+                  result->format_type,
+                  result->channels,
+                  result->sample_rate,
+                  result->byterate,
+                  result->block_align,
+                  result->bits_per_sample,
+                  result->data_size,
+                  result->data_size_difference,
+                  result->frames,
+                  20.0 * log10(result->peak),
+                  20.0 * log10(result->rms),
+                  result->dc_offset,
+                  20.0 * log10(result->hp_peak),
+                  result->clipped_samples);
+}
 
-    if (remaining_size_after_data < 0) {
-        printf("Data size is not valid\n");
-        int3();
-        goto unmap_file;
-    }
+static file_index_key_t job_index_key(const file_job_t* job) {
+    return (file_index_key_t){
+        .dev = job->dev,
+        .ino = job->ino,
+        .size = job->size,
+        .mtime_ns = job->mtime_ns
+    };
+}
 
-    printf("RIFF: %.4s, Size: %u, WAVE: %.4s, fmt: %.4s, fmt_size: %u, format_type: %u, channels: %u, sample_rate: %u, byterate: %u, block_align: %u, bits_per_sample: %u, data: %.4s, data_size: %u, data_size_difference: %ld\n",
-           riff_header.riff_marker,
-           riff_header.overall_size,
-           riff_header.wave_marker,
-           fmt_chunk.fmt_marker,
-           fmt_chunk.fmt_size,
-           fmt_chunk.format_type,
-           fmt_chunk.channels,
-           fmt_chunk.sample_rate,
-           fmt_chunk.byterate,
-           fmt_chunk.block_align,
-           fmt_chunk.bits_per_sample,
-           data_chunk.marker,
-           data_chunk.size,
-           remaining_size_after_data);
-
-    const u8* original_data = data_chunk_in_file + 8;
-
-    u32 data_size = align_size(data_chunk.size, getpagesize());
-    switch (fmt_chunk.bits_per_sample) {
-    case 24:
-        data_size = data_chunk.size / 3 * 4;
-        break;
-    default:
-        data_size = data_chunk.size;
+static u64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// With --no-cache-pollution, hints that the file is about to be read front to back
+static void expect_sequential(const i32 fd) {
+    if (options.no_cache_pollution) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
     }
+}
 
-    u8* data = mmap(NULL, data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (data == MAP_FAILED) {
-        int3();
-        goto unmap_file;
+// With --no-cache-pollution, drops [offset, offset + size) of the file from the page cache, size 0 runs to the end.
+// Pages still mapped anywhere stay, so mapped data has to be madvise()d away first
+static void drop_cached(const i32 fd, const u64 offset, const u64 size) {
+    if (options.no_cache_pollution) {
+        posix_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
     }
+}
 
-    i16* data_i16 = (i16*)data;
-    i32* data_i32 = (i32*)data;
-    f32* data_f32 = (f32*)data;
-    f64* data_f64 = (f64*)data;
+// Cached from /proc/meminfo in bytes, system-wide, 0 if it can't be read
+static u64 page_cache_size(void) {
+    FILE* file = fopen("/proc/meminfo", "re");
+    if (!file) {
+        return 0;
+    }
+    c line[256];
+    u64 cached_kb = 0;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "Cached: %lu kB", &cached_kb) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return KB(cached_kb);
+}
 
-    // if (fmt_chunk.channels != 4 || fmt_chunk.format_type != 65534 || fmt_chunk.bits_per_sample != 16) {
-    //     goto unmap_file;
-    // }
+// Picks the sample decoder from the format tag, WAVE_FORMAT_EXTENSIBLE carries the real one in its sub-format
+static sample_format_t sample_format_from_fmt(const wave_fmt_chunk_t* fmt, const u8* fmt_chunk_in_file) {
+    u16 format_type = fmt->format_type;
+    if (format_type == WAVE_FORMAT_EXTENSIBLE && fmt->fmt_size >= 40) {
+        memcpy(&format_type, fmt_chunk_in_file + 8 + 24, sizeof(u16));
+    }
 
-    switch (fmt_chunk.format_type) {
-    case 1:
-    case 65534:
-        switch (fmt_chunk.bits_per_sample) {
+    if (format_type == WAVE_FORMAT_PCM) {
+        switch (fmt->bits_per_sample) {
+        case 8:
+            return SAMPLE_U8;
         case 16:
-            for (u32 i = 0; i < data_chunk.size; i += sizeof(i16)) {
-                const u32 resulting_index = (i / sizeof(i16) / fmt_chunk.channels) + (data_chunk.size / sizeof(i16) / fmt_chunk.channels) * (i / sizeof(i16) % fmt_chunk.channels);
-                data_i16[resulting_index] = original_data[i];
-            }
+            return SAMPLE_I16;
+        case 24:
+            return SAMPLE_I24;
+        case 32:
+            return SAMPLE_I32;
+        default:
             break;
-        case 24: // 32
-            for (u32 i = 0; i < data_chunk.size; i += 3) {
-                const u32 resulting_index = (i / 3 / fmt_chunk.channels) + (data_chunk.size / 3 / fmt_chunk.channels) * (i / 3 % fmt_chunk.channels);
-                i32 widened_24bit_value;
-
-                u8* bytes = (u8*)&original_data[i];
-                i32 value;
+        }
+    } else if (format_type == WAVE_FORMAT_IEEE_FLOAT) {
+        switch (fmt->bits_per_sample) {
+        case 32:
+            return SAMPLE_F32;
+        case 64:
+            return SAMPLE_F64;
+        default:
+            break;
+        }
+    }
+    return SAMPLE_UNSUPPORTED;
+}
 
-                value = bytes[0] | bytes[1] << 8 | bytes[2] << 16;
+// Integer formats are scaled so the largest positive code is 1.0
+static inline f32 decode_sample(const u8* sample, const sample_format_t format) {
+    switch (format) {
+    case SAMPLE_U8:
+        return (sample[0] - 128) / 127.0f;
+    case SAMPLE_I16: {
+        i16 value;
+        memcpy(&value, sample, sizeof(value));
+        return value / 32767.0f;
+    }
+    case SAMPLE_I24: {
+        i32 value = sample[0] | sample[1] << 8 | sample[2] << 16;
+        if (value & 0x800000) {
+            value |= (i32)0xFF000000;
+        }
+        return value / 8388607.0f;
+    }
+    case SAMPLE_I32: {
+        i32 value;
+        memcpy(&value, sample, sizeof(value));
+        return (f32)(value / 2147483647.0);
+    }
+    case SAMPLE_F32: {
+        f32 value;
+        memcpy(&value, sample, sizeof(value));
+        return value;
+    }
+    case SAMPLE_F64: {
+        f64 value;
+        memcpy(&value, sample, sizeof(value));
+        return (f32)value;
+    }
+    default:
+        return 0.0f;
+    }
+}
 
-                if (value & 0x800000) {
-                    value |= (i32)0xFF000000;
-                }
+static inline void decode_channel(const u8* sample, const u32 stride, const u64 count, const sample_format_t format, f32* out) {
+    for (u64 i = 0; i < count; i++) {
+        out[i] = decode_sample(sample + i * stride, format);
+    }
+}
 
-                data_i32[resulting_index] = value;
-            }
-        case 32:
-            for (u32 i = 0; i < data_chunk.size; i += sizeof(i32)) {
-                const u32 resulting_index = (i / sizeof(i32) / fmt_chunk.channels) + (data_chunk.size / sizeof(i32) / fmt_chunk.channels) * (i / sizeof(i32) % fmt_chunk.channels);
-                data_i32[resulting_index] = original_data[i];
-            }
+// Splits frame_count interleaved frames into one run of frame_count samples per channel.
+// Every case passes decode_channel() a constant format, so each gets a loop of its own without a switch per sample
+static void deinterleave(const sample_layout_t* layout, const u8* data, const u64 frame_count, f32* planar) {
+    for (u16 channel = 0; channel < layout->channels; channel++) {
+        const u8* sample = data + channel * layout->bytes_per_sample;
+        f32* out = planar + channel * frame_count;
+        switch (layout->format) {
+        case SAMPLE_U8:
+            decode_channel(sample, layout->block_align, frame_count, SAMPLE_U8, out);
             break;
-        default:
+        case SAMPLE_I16:
+            decode_channel(sample, layout->block_align, frame_count, SAMPLE_I16, out);
             break;
-        }
-        break;
-    case 3:
-        switch (fmt_chunk.bits_per_sample) {
-        case 32:
-            for (u32 i = 0; i < data_chunk.size; i += sizeof(f32)) {
-                const u32 resulting_index = (i / sizeof(f32) / fmt_chunk.channels) + (data_chunk.size / sizeof(f32) / fmt_chunk.channels) * (i / sizeof(f32) % fmt_chunk.channels);
-                data_f32[resulting_index] = original_data[i];
-            }
+        case SAMPLE_I24:
+            decode_channel(sample, layout->block_align, frame_count, SAMPLE_I24, out);
             break;
-        case 64:
-            for (u32 i = 0; i < data_chunk.size; i += sizeof(f64)) {
-                const u32 resulting_index = (i / sizeof(f64) / fmt_chunk.channels) + (data_chunk.size / sizeof(f64) / fmt_chunk.channels) * (i / sizeof(f64) % fmt_chunk.channels);
-                data_f64[resulting_index] = original_data[i];
-            }
+        case SAMPLE_I32:
+            decode_channel(sample, layout->block_align, frame_count, SAMPLE_I32, out);
+            break;
+        case SAMPLE_F32:
+            decode_channel(sample, layout->block_align, frame_count, SAMPLE_F32, out);
+            break;
+        case SAMPLE_F64:
+            decode_channel(sample, layout->block_align, frame_count, SAMPLE_F64, out);
             break;
         default:
+            memset(out, 0, sizeof(f32) * frame_count);
             break;
         }
-    default:
-        goto unmap_data;
     }
+}
 
-unmap_data:
-    munmap(data, data_size);
-unmap_file:
-    munmap(file, sb.st_size);
-close_file:
-    close(fd);
+// Runs count samples of one channel through its filter, measuring all but the first skip_count of them
+static void measure_channel(const f32* x, const u64 count, const u64 skip_count, const f32 r, channel_metrics_t* m, channel_filter_t* filter) {
+    f32 x1 = filter->x1;
+    f32 y1 = filter->y1;
 
-    arena_clear(&arena_temp_tl);
+    u64 i = 0;
+    for (; i < skip_count; i++) {
+        y1 = x[i] - x1 + r * y1;
+        x1 = x[i];
+    }
 
-    return NULL;
+    for (; i < count; i++) {
+        const f32 y = x[i] - x1 + r * y1;
+        x1 = x[i];
+        y1 = y;
+
+        const f32 magnitude = fabsf(x[i]);
+        m->peak = magnitude > m->peak ? magnitude : m->peak;
+        m->hp_peak = fabsf(y) > m->hp_peak ? fabsf(y) : m->hp_peak;
+        m->sum += x[i];
+        m->sum_squares += (f64)x[i] * x[i];
+        m->clipped += magnitude >= 1.0f;
+    }
+
+    filter->x1 = x1;
+    filter->y1 = y1;
 }
 
-int main(const int argc, char* argv[]) {
-    if (argc < 2) {
-        printf("%s\n", "Please supply at least one argument.");
-        exit(1);
+// Measures frame_count frames at data into metrics, which start out zeroed. The first skip_count frames only run
+// through the filters: ranges after the first start them hp_warmup_frames early from silence, so they pick up
+// the filter state they would have had within HP_SETTLE_LEVEL.
+// Frames are decoded a block at a time into planar (PLANAR_BUFFER_SIZE bytes), so memory doesn't grow with the range
+static void measure_frames(const sample_layout_t* layout, const u8* data, const u64 frame_count, const u64 skip_count, channel_metrics_t* metrics, channel_filter_t* filters, f32* planar) {
+    if (frame_count == 0) {
+        return;
     }
+    const u16 channels = layout->channels;
+    const u64 block_frames = PLANAR_BUFFER_SIZE / (sizeof(f32) * channels);
 
-    arena_global = arena_make(GB(1));
+    for (u64 first = 0; first < frame_count; first += block_frames) {
+        const u64 count = frame_count - first < block_frames ? frame_count - first : block_frames;
+        const u64 skip = skip_count > first ? (skip_count - first < count ? skip_count - first : count) : 0;
+        deinterleave(layout, data + first * layout->block_align, count, planar);
+        for (u16 channel = 0; channel < channels; channel++) {
+            measure_channel(planar + channel * count, count, skip, layout->hp_coefficient, &metrics[channel], &filters[channel]);
+        }
+    }
+}
 
-    arena_temp = arena_make(MB(4));
+// Associative and commutative, ranges may be merged in any grouping
+static void merge_metrics(channel_metrics_t* into, const channel_metrics_t* from, const u16 channels) {
+    for (u16 channel = 0; channel < channels; channel++) {
+        into[channel].peak = from[channel].peak > into[channel].peak ? from[channel].peak : into[channel].peak;
+        into[channel].hp_peak = from[channel].hp_peak > into[channel].hp_peak ? from[channel].hp_peak : into[channel].hp_peak;
+        into[channel].sum += from[channel].sum;
+        into[channel].sum_squares += from[channel].sum_squares;
+        into[channel].clipped += from[channel].clipped;
+    }
+}
 
-    str_t* paths = array_from_size(str_t, &arena_global, argc - 1);
-    char* absolute_path_buffer = arena_alloc(&arena_temp, PATH_MAX);
+// File-level values are the loudest channel's, clipped samples are counted over all channels
+static void store_metrics(file_result_t* result, const channel_metrics_t* metrics, const u16 channels, const u64 frames) {
+    result->frames = frames;
+    if (frames == 0) {
+        return;
+    }
+    for (u16 channel = 0; channel < channels; channel++) {
+        const channel_metrics_t* m = &metrics[channel];
+        const f32 rms = (f32)sqrt(m->sum_squares / frames);
+        const f32 dc_offset = (f32)(m->sum / frames);
+        result->peak = m->peak > result->peak ? m->peak : result->peak;
+        result->hp_peak = m->hp_peak > result->hp_peak ? m->hp_peak : result->hp_peak;
+        result->rms = rms > result->rms ? rms : result->rms;
+        result->dc_offset = fabsf(dc_offset) > fabsf(result->dc_offset) ? dc_offset : result->dc_offset;
+        result->clipped_samples += m->clipped;
+    }
+}
 
-    for (u64 i = 1; i < argc; i++) {
-        if (realpath(argv[i], absolute_path_buffer)) {
-            const str_t absolute_path = str_from_cstr(&arena_global, absolute_path_buffer);
-            paths[i - 1] = absolute_path;
-            get_array_header(paths)->length++; // TODO: Add generic add/get functions to array.h
-        } else {
-            printf("Couldn't find real path for argument \"%s\"\n", argv[i]);
-        }
+// Called by workers once a job is done with its pages
+static void prefetch_release(const file_job_t* job) {
+    if (job->prefetched_bytes == 0) {
+        return;
     }
-    arena_clear(&arena_temp);
+    pthread_mutex_lock(&prefetch.mutex);
+    prefetch.in_flight -= job->prefetched_bytes;
+    pthread_cond_signal(&prefetch.released);
+    pthread_mutex_unlock(&prefetch.mutex);
+}
 
-    u32 file_counter = 0;
+static void watch_batch_release(watch_batch_t* batch) {
+    if (atomic_fetch_sub(&batch->pending, 1) != 1) {
+        return;
+    }
+    watch_batch_t* head = atomic_load(&finished_watch_batches);
+    do {
+        batch->next = head;
+    } while (!atomic_compare_exchange_weak(&finished_watch_batches, &head, batch));
+}
 
-    // TODO: REDO
-    for (u32 i = 0; i < get_array_length(paths); i++) {
-        struct stat path_stat;
-        const char* path_cstr = str_to_cstr(&arena_temp, paths[i]);
+// Every dispatched job ends here, the job may be gone right after
+static void finish_job(const file_job_t* job) {
+    watch_batch_t* batch = job->watch_batch;
+    atomic_fetch_add(&analyzed_count, 1);
+    if (batch) {
+        watch_batch_release(batch);
+    }
+}
 
-        if (stat(path_cstr, &path_stat) != 0) {
-            printf("Failed to get stats for path: %s\n", path_cstr);
-            continue;
+// Called by workers once a range is done with its reader buffer
+static void reader_release(reader_t* reader, const u32 buffer_index) {
+    queue_push(&reader->returned, (void*)(uptr)buffer_index);
+}
+
+static void finish_analysis(file_analysis_t* analysis, const u32 worker_index) {
+    const file_job_t* job = analysis->job;
+    file_result_t* result = &analysis->result;
+
+    channel_metrics_t* metrics = analysis->ranges[0].metrics;
+    for (u32 i = 1; i < analysis->range_count; i++) {
+        merge_metrics(metrics, analysis->ranges[i].metrics, analysis->layout.channels);
+    }
+    store_metrics(result, metrics, analysis->layout.channels, analysis->frame_count);
+
+    // Metrics of part of the file would pass for the whole file's, in the output and in the index
+    if (atomic_load(&analysis->read_failed)) {
+        output_printf(worker_index, "%s: not analyzed, samples couldn't be read\n", job->path.start);
+    } else {
+        print_result(worker_index, job->path, result);
+    }
+
+    if (options.index_path && !atomic_load(&analysis->read_failed)) {
+        const file_index_key_t key = job_index_key(job);
+        if (!file_index_append(&file_index, &key, result)) {
+            output_printf(worker_index, "Failed to append to the index: %s\n", strerror(errno));
         }
+    }
 
-        if (S_ISDIR(path_stat.st_mode)) {
-            DIR* dir = opendir(path_cstr);
-            if (dir == NULL) {
-                printf("Failed to open directory: %s\n", path_cstr);
+    if (analysis->map) {
+        munmap(analysis->map, analysis->map_size);
+    }
+    drop_cached(analysis->fd, 0, 0);
+    close(analysis->fd);
+    if (job->fd != -1) {
+        atomic_fetch_add(&fd_budget, 1);
+    }
+
+    if (arena_valid(&analysis->own_arena)) {
+        arena_t arena = analysis->own_arena;
+        arena_delete(&arena);
+    }
+
+    prefetch_release(job);
+    finish_job(job);
+}
+
+// Returns the bytes read, fewer than size only at the end of the file, -1 on errors
+static i64 read_at(const i32 fd, u8* buffer, const u64 size, const u64 offset) {
+    u64 done = 0;
+    while (done < size) {
+        const ssize_t result = pread(fd, buffer + done, size - done, offset + done);
+        if (result < 0) {
+            if (errno == EINTR) {
                 continue;
             }
+            return done > 0 ? (i64)done : -1;
+        }
+        if (result == 0) {
+            break;
+        }
+        done += result;
+    }
+    return done;
+}
 
-            struct dirent* entry;
-            while ((entry = readdir(dir)) != NULL) {
-                if (entry->d_name[0] == '.')
-                    continue;
+// Reads frames from warmup_start to the end of the range in IO_ALIGNMENT-aligned blocks of up to IO_BLOCK_SIZE.
+// A frame cut off at the end of a block is read again with the next one
+static void read_range(file_analysis_t* analysis, range_task_t* range, const u64 warmup_start, const worker_scratch_t* scratch, const u32 worker_index) {
+    u8* buffer = scratch->read_buffer;
+    const sample_layout_t* layout = &analysis->layout;
+    const u64 end = analysis->data_offset + (range->first_frame + range->frame_count) * layout->block_align;
+    u64 position = analysis->data_offset + warmup_start * layout->block_align;
+    u64 frame = warmup_start;
 
-                char full_path[PATH_MAX];
-                snprintf(full_path, sizeof(full_path), "%s/%s", path_cstr, entry->d_name);
+    while (position < end) {
+        const u64 block_start = position & ~(u64)(IO_ALIGNMENT - 1);
+        const u64 block_size = align_size(end - block_start, IO_ALIGNMENT) < IO_BLOCK_SIZE ? align_size(end - block_start, IO_ALIGNMENT) : IO_BLOCK_SIZE;
+        const i64 read_size = read_at(analysis->fd, buffer, block_size, block_start);
+        const u64 read_end = read_size > 0 && block_start + read_size < end ? block_start + read_size : end;
+        const u64 frames = read_size > 0 && read_end > position ? (read_end - position) / layout->block_align : 0;
+        if (frames == 0) {
+            output_printf(worker_index, "Failed to read %s: %s\n", analysis->job->path.start, read_size < 0 ? strerror(errno) : "file got shorter");
+            atomic_store(&analysis->read_failed, true);
+            return;
+        }
 
-                str_t entry_path = str_from_cstr(&arena_global, full_path);
-                struct stat entry_stat;
-                if (stat(full_path, &entry_stat) != 0) {
-                    printf("Failed to get stats for path: %s\n", full_path);
-                    continue;
-                }
-                if (entry_stat.st_mode & S_IFREG) {
-                    process_file(&entry_path);
-                    file_counter++;
-                }
-            }
-            closedir(dir);
-        } else if (S_ISREG(path_stat.st_mode)) {
-            process_file(&paths[i]);
-            file_counter++;
+        const u64 skip_count = frame < range->first_frame ? range->first_frame - frame : 0;
+        measure_frames(layout, buffer + (position - block_start), frames, skip_count < frames ? skip_count : frames, range->metrics, range->filters, scratch->planar);
+        drop_cached(analysis->fd, block_start, read_size);
+        frame += frames;
+        position += frames * layout->block_align;
+    }
+}
+
+// Every range warms its filters up on the frames before it, so a split file measures the same as a whole one
+static u64 range_warmup_start(const range_task_t* range, const sample_layout_t* layout) {
+    return range->first_frame > layout->hp_warmup_frames ? range->first_frame - layout->hp_warmup_frames : 0;
+}
+
+// Walks the range's mapped frames in windows of MAP_WINDOW_SIZE and unmaps each window's pages once it's measured,
+// so a huge file never has more than a window per range mapped in. The page cache keeps them, another range
+// reading across the edge of a window just maps them in again
+static void measure_mapped(const file_analysis_t* analysis, range_task_t* range, const u64 warmup_start, f32* planar) {
+    if (range->frame_count == 0) {
+        return;
+    }
+    const sample_layout_t* layout = &analysis->layout;
+    const u64 window_frames = MAP_WINDOW_SIZE / layout->block_align > 0 ? MAP_WINDOW_SIZE / layout->block_align : 1;
+    const u64 end_frame = range->first_frame + range->frame_count;
+    uptr released = align_size((uptr)(analysis->data + warmup_start * layout->block_align), MAP_RELEASE_ALIGNMENT);
+
+    for (u64 frame = warmup_start; frame < end_frame; frame += window_frames) {
+        const u64 count = end_frame - frame < window_frames ? end_frame - frame : window_frames;
+        const u64 skip_count = frame < range->first_frame ? range->first_frame - frame : 0;
+        const u8* window = analysis->data + frame * layout->block_align;
+        measure_frames(layout, window, count, skip_count < count ? skip_count : count, range->metrics, range->filters, planar);
+
+        // Up to the last MAP_RELEASE_ALIGNMENT boundary measured, the rest goes with the next window or munmap()
+        const uptr measured = ((uptr)window + count * layout->block_align) & ~(uptr)(MAP_RELEASE_ALIGNMENT - 1);
+        if (count == window_frames && measured > released) {
+            madvise((void*)released, measured - released, MADV_DONTNEED);
+            drop_cached(analysis->fd, released - (uptr)analysis->map, measured - released);
+            released = measured;
         }
+    }
+}
 
-        arena_clear(&arena_temp);
+static void run_range(sched_task_t* task, const u32 worker_index) {
+    range_task_t* range = (range_task_t*)task;
+    file_analysis_t* analysis = range->analysis;
+    const sample_layout_t* layout = &analysis->layout;
+
+    const worker_scratch_t* scratch = &worker_scratch[worker_index];
+    const u64 warmup_start = range_warmup_start(range, layout);
+    memset(range->filters, 0, sizeof(channel_filter_t) * layout->channels);
+
+    if (range->block) {
+        measure_frames(layout, range->block, range->first_frame + range->frame_count - warmup_start, range->first_frame - warmup_start, range->metrics, range->filters, scratch->planar);
+        reader_release(analysis->reader, range->buffer_index);
+
+        // O_DIRECT reads only leave pages behind where the filesystem doesn't support it
+        const u64 start = analysis->data_offset + warmup_start * layout->block_align;
+        drop_cached(analysis->fd, start, (range->first_frame + range->frame_count - warmup_start) * layout->block_align);
+    } else if (analysis->data) {
+        measure_mapped(analysis, range, warmup_start, scratch->planar);
+    } else {
+        read_range(analysis, range, warmup_start, scratch, worker_index);
+    }
+    atomic_fetch_add_explicit(&measured_bytes, range->frame_count * analysis->layout.block_align, memory_order_relaxed);
+
+    // The last range to finish merges and reports the file
+    if (atomic_fetch_sub(&analysis->remaining_ranges, 1) == 1) {
+        finish_analysis(analysis, worker_index);
+    }
+}
+
+typedef enum {
+    HEADER_OK,
+    HEADER_INVALID,
+    HEADER_TRUNCATED // The chunks run past the bytes that were read
+} header_status_t;
+
+typedef struct {
+    wave_riff_header_t riff;
+    wave_fmt_chunk_t fmt;
+    sample_format_t format;
+    u64 data_offset; // Of the samples, past the data chunk header
+    u32 data_size;
+    i64 remaining_size_after_data;
+} wave_header_t;
+
+// Follows the chunks in the first available bytes of a file_size byte file.
+// Broken files are only reported once the whole file is available
+static header_status_t parse_header(const u8* file, const u64 available, const u64 file_size, const file_job_t* job, wave_header_t* header, const u32 worker_index) {
+    const bool whole_file = available == file_size;
+
+    if (file_size < 12) {
+        output_printf(worker_index, "Skipping %.*s: too short for a RIFF header\n", (int)job->path.length, job->path.start);
+        return HEADER_INVALID;
+    }
+    if (available < 12) {
+        return HEADER_TRUNCATED;
     }
 
-    printf("%u", file_counter);
+    memcpy(&header->riff, file, 12);
+
+    if (memcmp(header->riff.riff_marker, "RIFF", 4) != 0) {
+        output_printf(worker_index, "Unsupported RIFF variant %.4s: %.*s\n", header->riff.riff_marker, (int)job->path.length, job->path.start);
+        return HEADER_INVALID;
+    }
+
+    if (available < 12 + sizeof(wave_fmt_chunk_t)) {
+        if (!whole_file) {
+            return HEADER_TRUNCATED;
+        }
+        output_printf(worker_index, "Skipping %.*s: no fmt chunk\n", (int)job->path.length, job->path.start);
+        return HEADER_INVALID;
+    }
+
+    const u8* fmt_chunk_in_file = file + 12;
+    while (memcmp(fmt_chunk_in_file, "fmt ", 4) != 0) {
+        u32 next_chunk_size;
+        memcpy(&next_chunk_size, fmt_chunk_in_file + 4, sizeof(u32));
+        fmt_chunk_in_file += 8 + next_chunk_size + (next_chunk_size & 1);
+        if (fmt_chunk_in_file > file + available - sizeof(wave_fmt_chunk_t)) {
+            if (!whole_file) {
+                return HEADER_TRUNCATED;
+            }
+            output_printf(worker_index, "Skipping %.*s: no fmt chunk\n", (int)job->path.length, job->path.start);
+            return HEADER_INVALID;
+        }
+    }
+
+    memcpy(&header->fmt, fmt_chunk_in_file, sizeof(wave_fmt_chunk_t));
+
+    // The extensible format's subtype is further into the chunk
+    const u8* data_chunk_in_file = fmt_chunk_in_file + 8 + header->fmt.fmt_size + (header->fmt.fmt_size & 1);
+    if (data_chunk_in_file > file + available - sizeof(wave_generic_chunk_t)) {
+        if (!whole_file) {
+            return HEADER_TRUNCATED;
+        }
+        output_printf(worker_index, "Skipping %.*s: no data chunk\n", (int)job->path.length, job->path.start);
+        return HEADER_INVALID;
+    }
+
+    while (memcmp(data_chunk_in_file, "data", 4) != 0) {
+        u32 next_chunk_size;
+        memcpy(&next_chunk_size, data_chunk_in_file + 4, sizeof(u32));
+        data_chunk_in_file += 8 + next_chunk_size + (next_chunk_size & 1);
+        if (data_chunk_in_file > file + available - sizeof(wave_generic_chunk_t)) {
+            if (!whole_file) {
+                return HEADER_TRUNCATED;
+            }
+            output_printf(worker_index, "Skipping %.*s: no data chunk\n", (int)job->path.length, job->path.start);
+            return HEADER_INVALID;
+        }
+    }
+
+    wave_generic_chunk_t data_chunk = {};
+    memcpy(&data_chunk, data_chunk_in_file, sizeof(wave_generic_chunk_t));
+
+    header->data_offset = data_chunk_in_file + 8 - file;
+    header->data_size = data_chunk.size;
+    header->remaining_size_after_data = (i64)(file_size - header->data_offset) - data_chunk.size;
+
+    if (header->remaining_size_after_data < 0) {
+        output_printf(worker_index, "Skipping %.*s: data chunk runs past the end of the file\n", (int)job->path.length, job->path.start);
+        return HEADER_INVALID;
+    }
+
+    header->format = sample_format_from_fmt(&header->fmt, fmt_chunk_in_file);
+    return HEADER_OK;
+}
+
+// Fills layout from the fmt chunk, returns the number of frames to measure
+static u64 layout_from_header(const wave_header_t* header, sample_layout_t* layout) {
+    *layout = (sample_layout_t){
+        .format = header->format,
+        .channels = header->fmt.channels,
+        .bytes_per_sample = header->fmt.bits_per_sample / 8,
+        .block_align = header->fmt.block_align
+    };
+    if (layout->channels == 0 || layout->block_align != layout->channels * layout->bytes_per_sample) {
+        layout->format = SAMPLE_UNSUPPORTED;
+    }
+
+    // One-pole DC blocker with its corner at HP_CUTOFF_HZ, warm-up is how long it takes to forget its state
+    const f64 sample_rate = header->fmt.sample_rate > 0 ? header->fmt.sample_rate : 48000;
+    const f64 r = exp(-2.0 * M_PI * HP_CUTOFF_HZ / sample_rate);
+    layout->hp_coefficient = (f32)r;
+    layout->hp_warmup_frames = (u64)ceil(log(HP_SETTLE_LEVEL) / log(r));
+
+    return layout->format != SAMPLE_UNSUPPORTED ? header->data_size / layout->block_align : 0;
+}
+
+// Sets up the analysis of frame_count frames in range_count ranges, the first first_range_frames long and the others
+// frames_per_range. State goes into arena, or into an arena of its own when that's NULL. Returns NULL if it can't be allocated
+static file_analysis_t* make_analysis(const file_job_t* job, const i32 fd, u8* map, const wave_header_t* header, const sample_layout_t* layout, const u64 frame_count, const u32 range_count, const u64 first_range_frames, const u64 frames_per_range, arena_t* arena, const u32 worker_index) {
+    arena_t own_arena = { 0 };
+    if (!arena) {
+        const u64 range_state_size = align_size(sizeof(channel_metrics_t) * layout->channels, 8) + align_size(sizeof(channel_filter_t) * layout->channels, 8);
+        own_arena = arena_make(sizeof(file_analysis_t) + (sizeof(range_task_t) + range_state_size) * range_count);
+        if (!arena_valid(&own_arena)) {
+            output_printf(worker_index, "Failed to allocate analysis state: %s\n", job->path.start);
+            return NULL;
+        }
+        arena = &own_arena;
+    }
+
+    file_analysis_t* analysis = arena_alloc(arena, sizeof(file_analysis_t));
+    range_task_t* ranges = arena_alloc(arena, sizeof(range_task_t) * range_count);
+    if (!analysis || !ranges) {
+        goto fail;
+    }
+    *analysis = (file_analysis_t){
+        .job = job,
+        .fd = fd,
+        .map = map,
+        .map_size = job->size,
+        .layout = *layout,
+        .data = map ? map + header->data_offset : NULL,
+        .data_offset = header->data_offset,
+        .frame_count = frame_count,
+        .ranges = ranges,
+        .range_count = range_count
+    };
+    atomic_init(&analysis->remaining_ranges, range_count);
+    atomic_init(&analysis->read_failed, false);
+    analysis->result = (file_result_t){
+        .riff_size = header->riff.overall_size,
+        .fmt_size = header->fmt.fmt_size,
+        .format_type = header->fmt.format_type,
+        .channels = header->fmt.channels,
+        .sample_rate = header->fmt.sample_rate,
+        .byterate = header->fmt.byterate,
+        .block_align = header->fmt.block_align,
+        .bits_per_sample = header->fmt.bits_per_sample,
+        .data_size = header->data_size,
+        .data_size_difference = header->remaining_size_after_data
+    };
+
+    for (u32 i = 0; i < range_count; i++) {
+        const u64 start = i == 0 ? 0 : first_range_frames + (i - 1) * frames_per_range;
+        const u64 end = i == 0 ? first_range_frames : start + frames_per_range;
+        const u64 first_frame = start < frame_count ? start : frame_count;
+        const u64 end_frame = end < frame_count ? end : frame_count;
+        ranges[i] = (range_task_t){
+            .task = { .run = run_range },
+            .analysis = analysis,
+            .first_frame = first_frame,
+            .frame_count = end_frame - first_frame,
+            .metrics = arena_alloc(arena, sizeof(channel_metrics_t) * layout->channels),
+            .filters = arena_alloc(arena, sizeof(channel_filter_t) * layout->channels)
+        };
+        if (!ranges[i].metrics || !ranges[i].filters) {
+            goto fail;
+        }
+        memset(ranges[i].metrics, 0, sizeof(channel_metrics_t) * layout->channels);
+    }
+    analysis->own_arena = own_arena;
+    return analysis;
+
+fail:
+    output_printf(worker_index, "Failed to allocate analysis state: %s\n", job->path.start);
+    if (arena_valid(&own_arena)) {
+        arena_delete(&own_arena);
+    }
+    return NULL;
+}
+
+// Parses the file's chunks and, unless it's read with pread() (see read_range()), maps it.
+// Returns NULL if the file couldn't be parsed. Unless the file is split, its state lives in scratch until the caller resets it
+static file_analysis_t* open_analysis(const file_job_t* job, worker_scratch_t* scratch, const u32 worker_index) {
+    int fd = job->fd;
+    if (fd == -1) {
+        fd = open(job->path.start, O_RDONLY | O_CLOEXEC);
+    }
+
+    if (fd == -1) {
+        output_printf(worker_index, "Failed to open %s: %s\n", job->path.start, strerror(errno));
+        return NULL;
+    }
+    expect_sequential(fd);
+
+    // Size comes from the statx() issued during discovery
+    const u64 file_size = job->size;
+
+    u8* file = NULL;
+    wave_header_t header;
+    header_status_t status = HEADER_TRUNCATED;
+
+    if (options.io == IO_PREAD || options.io == IO_DIRECT) {
+        // Where the filesystem doesn't do O_DIRECT this stays a buffered read
+        if (options.io == IO_DIRECT) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+        }
+        const u64 header_size = file_size < IO_HEADER_SIZE ? file_size : IO_HEADER_SIZE;
+        const i64 read_size = read_at(fd, scratch->read_buffer, align_size(header_size, IO_ALIGNMENT), 0);
+        if (read_size >= 0) {
+            status = parse_header(scratch->read_buffer, (u64)read_size < file_size ? (u64)read_size : file_size, file_size, job, &header, worker_index);
+        }
+    }
+
+    // Chunks past the first IO_HEADER_SIZE bytes are found through a mapping, which the file is then measured from
+    if (status == HEADER_TRUNCATED) {
+        file = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE | (options.io == IO_POPULATE ? MAP_POPULATE : 0), fd, 0);
+        if (file == MAP_FAILED) {
+            file = NULL;
+            output_printf(worker_index, "Failed to map %s: %s\n", job->path.start, strerror(errno));
+            goto close_file;
+        }
+        status = parse_header(file, file_size, file_size, job, &header, worker_index);
+    }
+
+    if (status != HEADER_OK) {
+        goto unmap_file;
+    }
+
+    sample_layout_t layout;
+    const u64 frame_count = layout_from_header(&header, &layout);
+
+    // Big enough data chunks are measured in block-aligned ranges on several workers
+    u32 range_count = 1;
+    if (options.split_threshold > 0 && header.data_size >= options.split_threshold && options.threads > 1 && frame_count > 0) {
+        const u64 ranges_by_size = (header.data_size + SPLIT_MIN_RANGE_SIZE - 1) / SPLIT_MIN_RANGE_SIZE;
+        const u64 ranges_by_threads = (u64)options.threads * SPLIT_RANGES_PER_THREAD;
+        range_count = ranges_by_size < ranges_by_threads ? ranges_by_size : ranges_by_threads;
+    }
+
+    // A split file outlives this call and may finish on any worker, so its state gets an arena of its own
+    const u64 frames_per_range = (frame_count + range_count - 1) / range_count;
+    file_analysis_t* analysis = make_analysis(job, fd, file, &header, &layout, frame_count, range_count, frames_per_range, frames_per_range, range_count > 1 ? NULL : &scratch->arena, worker_index);
+    if (!analysis) {
+        goto unmap_file;
+    }
+    return analysis;
+
+unmap_file:
+    if (file) {
+        munmap(file, file_size);
+    }
+close_file:
+    drop_cached(fd, 0, 0);
+    close(fd);
+    if (job->fd != -1) {
+        atomic_fetch_add(&fd_budget, 1);
+    }
+    return NULL;
+}
+
+// Scratch is reset after every file, its pages are only given back once it has grown past options.scratch_limit
+static void reset_scratch(worker_scratch_t* scratch) {
+    if (scratch->arena.position > scratch->high_water) {
+        scratch->high_water = scratch->arena.position;
+    }
+    if (scratch->high_water > options.scratch_limit) {
+        arena_release(&scratch->arena);
+        scratch->high_water = 0;
+    } else {
+        arena_clear(&scratch->arena);
+    }
+}
+
+static void note_job_start(void) {
+    const u64 start = now_ns();
+    u64 last = atomic_load(&last_start_ns);
+    while (last < start && !atomic_compare_exchange_weak(&last_start_ns, &last, start)) {
+    }
+}
+
+static void run_file_job(sched_task_t* task, const u32 worker_index) {
+    note_job_start();
+
+    const file_job_t* job = (const file_job_t*)task;
+    worker_scratch_t* scratch = &worker_scratch[worker_index];
+    file_analysis_t* analysis = open_analysis(job, scratch, worker_index);
+
+    if (!analysis) {
+        prefetch_release(job);
+        finish_job(job);
+    } else if (analysis->range_count == 1) {
+        run_range(&analysis->ranges[0].task, worker_index);
+    } else {
+        // Ranges go onto this worker's deque, idle workers steal them from the other end
+        for (u32 i = 0; i < analysis->range_count; i++) {
+            sched_spawn(sched, worker_index, &analysis->ranges[i].task);
+        }
+    }
+
+    reset_scratch(scratch);
+}
+
+typedef struct {
+    c id[4];
+    u64 offset; // Of the chunk header
+    u64 size;
+} probe_chunk_t;
+
+// Copies size bytes at offset out of the first read if it has them, reads them on their own otherwise
+static bool probe_read(const i32 fd, const u8* first, const u64 first_size, void* out, const u64 size, const u64 offset) {
+    if (offset + size <= first_size) {
+        memcpy(out, first + offset, size);
+        return true;
+    }
+    return read_at(fd, out, size, offset) == (i64)size;
+}
+
+// --probe: follows the chunk headers from one PROBE_READ_SIZE read, with a small pread() for every header past it,
+// and never touches sample data. Prints the format, the duration and the chunk directory.
+// RF64/BW64 files get their data size from the ds64 chunk
+static void run_probe_job(sched_task_t* task, const u32 worker_index) {
+    note_job_start();
+
+    const file_job_t* job = (const file_job_t*)task;
+    worker_scratch_t* scratch = &worker_scratch[worker_index];
+
+    const i32 fd = job->fd != -1 ? job->fd : open(job->path.start, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        output_printf(worker_index, "Failed to open %s: %s\n", job->path.start, strerror(errno));
+        finish_job(job);
+        return;
+    }
+
+    u8* first = arena_alloc(&scratch->arena, PROBE_READ_SIZE);
+    probe_chunk_t* chunks = arena_alloc(&scratch->arena, sizeof(probe_chunk_t) * PROBE_MAX_CHUNKS);
+    const i64 read_size = read_at(fd, first, job->size < PROBE_READ_SIZE ? job->size : PROBE_READ_SIZE, 0);
+    const u64 first_size = read_size > 0 ? read_size : 0;
+
+    wave_riff_header_t riff = { 0 };
+    wave_fmt_chunk_t fmt = { 0 };
+    u16 sub_format = 0;
+    u64 ds64_data_size = UINT32_MAX;
+    u64 data_size = 0;
+    u32 chunk_count = 0;
+    u64 position = sizeof(riff);
+    probe_read(fd, first, first_size, &riff, sizeof(riff), 0);
+
+    while (chunk_count < PROBE_MAX_CHUNKS && position + sizeof(wave_generic_chunk_t) <= job->size) {
+        wave_generic_chunk_t header;
+        if (!probe_read(fd, first, first_size, &header, sizeof(header), position)) {
+            break;
+        }
+        u64 size = header.size;
+
+        if (memcmp(header.marker, "ds64", 4) == 0 && size >= 3 * sizeof(u64)) {
+            u64 sizes[3]; // RIFF, data, sample count
+            if (probe_read(fd, first, first_size, sizes, sizeof(sizes), position + 8)) {
+                ds64_data_size = sizes[1];
+            }
+        } else if (memcmp(header.marker, "fmt ", 4) == 0 && fmt.fmt_size == 0 && size >= 16) {
+            // The extensible format's subtype is 24 bytes into the chunk
+            u8 body[26] = { 0 };
+            if (probe_read(fd, first, first_size, body, size < sizeof(body) ? size : sizeof(body), position + 8)) {
+                memcpy(&fmt, &header, sizeof(header));
+                memcpy((u8*)&fmt + sizeof(header), body, sizeof(wave_fmt_chunk_t) - sizeof(header));
+                memcpy(&sub_format, body + 24, sizeof(u16));
+            }
+        } else if (memcmp(header.marker, "data", 4) == 0) {
+            size = size == UINT32_MAX ? ds64_data_size : size;
+            data_size = size;
+        }
+
+        probe_chunk_t* chunk = &chunks[chunk_count++];
+        *chunk = (probe_chunk_t){ .offset = position, .size = size };
+        for (u32 i = 0; i < 4; i++) {
+            chunk->id[i] = header.marker[i] >= ' ' && header.marker[i] <= '~' ? header.marker[i] : '?';
+        }
+        position += sizeof(header) + size + (size & 1);
+    }
+
+    c format_type[32];
+    if (fmt.format_type == WAVE_FORMAT_EXTENSIBLE && fmt.fmt_size >= 26) {
+        snprintf(format_type, sizeof(format_type), "%u (%u)", fmt.format_type, sub_format);
+    } else {
+        snprintf(format_type, sizeof(format_type), "%u", fmt.format_type);
+    }
+
+    // Scratch memory is reused, it holds the last file's list until written over
+    c* list = arena_alloc(&scratch->arena, PROBE_MAX_CHUNKS * 64);
+    list[0] = '\0';
+    u64 length = 0;
+    for (u32 i = 0; i < chunk_count; i++) {
+        length += snprintf(list + length, PROBE_MAX_CHUNKS * 64 - length, "%s%.4s @%lu+%lu", i > 0 ? ", " : "", chunks[i].id, chunks[i].offset, chunks[i].size);
+    }
+    const c* note = chunk_count == 0 ? "none (no chunk headers after the RIFF header)" :
+                    position > job->size ? " (last chunk runs past the end of the file)" :
+                    chunk_count == PROBE_MAX_CHUNKS ? " (more chunks not listed)" : "";
+
+    const u64 frames = fmt.block_align > 0 ? data_size / fmt.block_align : 0;
+    output_printf(worker_index, "%.*s: RIFF: %.4s, Size: %u, format_type: %s, channels: %u, sample_rate: %u, byterate: %u, block_align: %u, bits_per_sample: %u, data_size: %lu, frames: %lu, duration: %.3fs, chunks: %s%s\n",
+                  (int)job->path.length,
+                  job->path.start,
+                  riff.riff_marker,
+                  riff.overall_size,
+                  format_type,
+                  fmt.channels,
+                  fmt.sample_rate,
+                  fmt.byterate,
+                  fmt.block_align,
+                  fmt.bits_per_sample,
+                  data_size,
+                  frames,
+                  fmt.sample_rate > 0 ? (f64)frames / fmt.sample_rate : 0.0,
+                  list,
+                  note);
+
+    drop_cached(fd, 0, 0);
+    close(fd);
+    if (job->fd != -1) {
+        atomic_fetch_add(&fd_budget, 1);
+    }
+    finish_job(job);
+    reset_scratch(scratch);
+}
+
+static bool fd_budget_acquire(const i64 count) {
+    if (atomic_fetch_sub(&fd_budget, count) >= count) {
+        return true;
+    }
+    atomic_fetch_add(&fd_budget, count);
+    return false;
+}
+
+// Raises the soft fd limit to the hard one and leaves RESERVED_FDS for everything but queued jobs
+static void fd_budget_init(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        atomic_store(&fd_budget, 0);
+        return;
+    }
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    const i64 available = limit.rlim_cur == RLIM_INFINITY ? INT32_MAX : (i64)limit.rlim_cur;
+    atomic_store(&fd_budget, available > RESERVED_FDS ? available - RESERVED_FDS : 0);
+}
+
+static bool discover_init(discover_t* discover, arena_t* arena) {
+    discover->ops = arena_alloc(arena, sizeof(meta_op_t) * WALK_BATCH_SIZE);
+    discover->candidates = arena_alloc(arena, sizeof(walk_entry_t*) * WALK_BATCH_SIZE);
+    discover->jobs = arena_alloc(arena, sizeof(file_job_t*) * WALK_BATCH_SIZE);
+    if (options.size_window > 0) {
+        discover->window = arena_alloc(arena, sizeof(file_job_t*) * options.size_window);
+    }
+    if (!discover->ops || !discover->candidates || !discover->jobs || (options.size_window > 0 && !discover->window)) {
+        return false;
+    }
+    meta_init(&discover->meta, options.meta_depth, options.use_uring);
+    return true;
+}
+
+static bool has_wav_extension(const str_t path) {
+    static const c* extensions[] = { ".wav", ".bwf" };
+
+    for (u64 i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        const size_t extension_length = strlen(extensions[i]);
+        if (path.length >= extension_length && strncasecmp(path.start + path.length - extension_length, extensions[i], extension_length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads the first 12 bytes and checks for RIFF, RF64 or BW64 followed by WAVE
+static bool has_wav_header(const i32 fd) {
+    u8 header[12];
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header)) {
+        return false;
+    }
+    const bool riff = memcmp(header, "RIFF", 4) == 0 || memcmp(header, "RF64", 4) == 0 || memcmp(header, "BW64", 4) == 0;
+    return riff && memcmp(header + 8, "WAVE", 4) == 0;
+}
+
+// Physical byte offset of the file's first extent on its device
+static bool file_physical_offset(const i32 fd, u64* offset) {
+    u8 buffer[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = { 0 };
+    struct fiemap* fiemap = (struct fiemap*)buffer;
+    fiemap->fm_start = 0;
+    fiemap->fm_length = FIEMAP_MAX_OFFSET;
+    fiemap->fm_extent_count = 1;
+
+    if (ioctl(fd, FS_IOC_FIEMAP, fiemap) != 0 || fiemap->fm_mapped_extents == 0) {
+        return false;
+    }
+    *offset = fiemap->fm_extents[0].fe_physical;
+    return true;
+}
+
+static u64 file_order_key(const i32 fd, const u64 ino) {
+    u64 offset;
+    if (options.order == ORDER_PHYSICAL && file_physical_offset(fd, &offset)) {
+        return offset;
+    }
+    return ino;
+}
+
+static int compare_jobs_by_order_key(const void* a, const void* b) {
+    const file_job_t* job_a = *(file_job_t* const*)a;
+    const file_job_t* job_b = *(file_job_t* const*)b;
+    if (job_a->dev != job_b->dev) {
+        return job_a->dev < job_b->dev ? -1 : 1;
+    }
+    if (job_a->order_key != job_b->order_key) {
+        return job_a->order_key < job_b->order_key ? -1 : 1;
+    }
+    return job_a->ino < job_b->ino ? -1 : job_a->ino > job_b->ino;
+}
+
+static int compare_jobs_by_size(const void* a, const void* b) {
+    const file_job_t* job_a = *(file_job_t* const*)a;
+    const file_job_t* job_b = *(file_job_t* const*)b;
+    if (job_a->size != job_b->size) {
+        return job_a->size > job_b->size ? -1 : 1;
+    }
+    return job_a->ino < job_b->ino ? -1 : job_a->ino > job_b->ino;
+}
+
+// Gathers the jobs held back by all sources, sorted by size or by device and order key
+static file_job_t** collect_sorted_jobs(arena_t* arena, discover_t* const* discoverers, const u64 discoverer_count, u64* job_count) {
+    u64 count = 0;
+    for (u64 i = 0; i < discoverer_count; i++) {
+        count += discoverers[i]->collected_count;
+    }
+
+    file_job_t** jobs = arena_alloc(arena, sizeof(file_job_t*) * (count + 1));
+    if (!jobs) {
+        *job_count = 0;
+        return NULL;
+    }
+
+    u64 position = 0;
+    for (u64 i = 0; i < discoverer_count; i++) {
+        for (file_job_t* job = discoverers[i]->collected; job; job = job->next) {
+            jobs[position++] = job;
+        }
+    }
+
+    qsort(jobs, count, sizeof(file_job_t*), options.order == ORDER_SIZE ? compare_jobs_by_size : compare_jobs_by_order_key);
+    *job_count = count;
+    return jobs;
+}
+
+static void window_swap(file_job_t** window, const u64 a, const u64 b) {
+    file_job_t* job = window[a];
+    window[a] = window[b];
+    window[b] = job;
+}
+
+// Removes and returns the largest job from the window
+static file_job_t* window_pop(discover_t* discover) {
+    file_job_t** window = discover->window;
+    file_job_t* largest = window[0];
+    window[0] = window[--discover->window_count];
+
+    u64 i = 0;
+    while (true) {
+        const u64 left = i * 2 + 1;
+        const u64 right = left + 1;
+        u64 next = i;
+        if (left < discover->window_count && window[left]->size > window[next]->size) {
+            next = left;
+        }
+        if (right < discover->window_count && window[right]->size > window[next]->size) {
+            next = right;
+        }
+        if (next == i) {
+            break;
+        }
+        window_swap(window, i, next);
+        i = next;
+    }
+    return largest;
+}
+
+static void window_push(discover_t* discover, file_job_t* job) {
+    file_job_t** window = discover->window;
+    u64 i = discover->window_count++;
+    window[i] = job;
+    while (i > 0 && window[(i - 1) / 2]->size < window[i]->size) {
+        window_swap(window, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+// Follows the chunk headers with pread() to find the data chunk, falls back to the whole file
+static void find_data_range(const i32 fd, const u64 file_size, u64* offset, u64* size) {
+    *offset = 0;
+    *size = file_size;
+
+    u64 position = 12;
+    for (u32 i = 0; i < PREFETCH_MAX_CHUNKS && position + sizeof(wave_generic_chunk_t) <= file_size; i++) {
+        wave_generic_chunk_t chunk;
+        if (pread(fd, &chunk, sizeof(chunk), position) != sizeof(chunk)) {
+            return;
+        }
+        position += sizeof(chunk);
+        if (memcmp(chunk.marker, "data", 4) == 0) {
+            *offset = position;
+            *size = chunk.size < file_size - position ? chunk.size : file_size - position;
+            return;
+        }
+        position += chunk.size + (chunk.size & 1);
+    }
+}
+
+// Worker group on the node whose page cache holds the middle of the data chunk, -1 if that page isn't cached.
+// One page is only a sample, but files are usually read into the cache as a whole
+static i32 cached_group(const i32 fd, const u64 offset, const u64 size) {
+    if (size == 0) {
+        return -1;
+    }
+    const u64 page_size = sysconf(_SC_PAGESIZE);
+    u8* page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, (offset + size / 2) & ~(page_size - 1));
+    if (page == MAP_FAILED) {
+        return -1;
+    }
+
+    i32 group = -1;
+    u8 resident = 0;
+    if (mincore(page, page_size, &resident) == 0 && (resident & 1)) {
+        group = numa_index_of(&numa, numa_node_of(page));
+    }
+    munmap(page, page_size);
+    return group;
+}
+
+// Waits until the job's data chunk fits into the budget, then starts reading it into the page cache.
+// A chunk bigger than the whole budget is cut to the budget and only waits for everything else to finish.
+// With --numa returns the worker group the job should go to, -1 for any
+static i32 prefetch_job(file_job_t* job) {
+    i32 fd = job->fd;
+    if (fd == -1 && (fd = open(job->path.start, O_RDONLY | O_CLOEXEC)) == -1) {
+        return -1;
+    }
+
+    u64 offset;
+    u64 size;
+    find_data_range(fd, job->size, &offset, &size);
+    if (size > options.prefetch_budget) {
+        size = options.prefetch_budget;
+    }
+
+    pthread_mutex_lock(&prefetch.mutex);
+    while (prefetch.in_flight > 0 && prefetch.in_flight + size > options.prefetch_budget) {
+        pthread_cond_wait(&prefetch.released, &prefetch.mutex);
+    }
+    prefetch.in_flight += size;
+    pthread_mutex_unlock(&prefetch.mutex);
+    job->prefetched_bytes = size;
+
+    i32 group = -1;
+    if (options.numa && (group = cached_group(fd, offset, size)) == -1) {
+        // Not cached yet, so read it in on the node of the group that will get it
+        group = prefetch.next_group++ % numa.node_count;
+        numa_prefer(numa.nodes[group]);
+    }
+
+    // readahead() only works on some filesystems, fadvise() is the portable version of the same hint
+    if (readahead(fd, offset, size) != 0) {
+        posix_fadvise(fd, offset, size, POSIX_FADV_WILLNEED);
+    }
+
+    if (fd != job->fd) {
+        close(fd);
+    }
+    return group;
+}
+
+static void* prefetch_thread_main(void* arg) {
+    file_job_t* job;
+    while (queue_pop(&prefetch.queue, (void**)&job)) {
+        const i32 group = prefetch_job(job);
+        if (group >= 0) {
+            sched_submit_to(sched, group, &job->task);
+        } else {
+            sched_submit(sched, &job->task);
+        }
+    }
+    sched_close(sched);
+    return NULL;
+}
+
+static bool prefetch_start(void) {
+    pthread_mutex_init(&prefetch.mutex, NULL);
+    pthread_cond_init(&prefetch.released, NULL);
+    return queue_init(&prefetch.queue, &arena_global, PREFETCH_QUEUE_CAPACITY) &&
+           pthread_create(&prefetch.thread, NULL, prefetch_thread_main, NULL) == 0;
+}
+
+static u8* reader_buffer(const reader_t* reader, const u32 index) {
+    return reader->buffers + (u64)index * IO_BLOCK_SIZE;
+}
+
+// Where a read of what's left of the block starts. O_DIRECT wants it aligned, so a partly read piece is read again
+static u64 reader_resume_offset(const reader_block_t* block) {
+    return block->done & ~(u64)(IO_ALIGNMENT - 1);
+}
+
+// Queues a read of what's left of the block, the ring has an entry for every buffer
+static void reader_issue(reader_t* reader, const u32 index) {
+    reader_block_t* block = &reader->blocks[index];
+    const u64 resume = reader_resume_offset(block);
+    block->reading = true;
+    struct io_uring_sqe* sqe = uring_get_sqe(&reader->ring);
+    sqe->opcode = reader->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = block->fd;
+    sqe->addr = (u64)(uptr)(reader_buffer(reader, index) + resume);
+    sqe->len = block->size - resume;
+    sqe->off = block->offset + resume;
+    sqe->buf_index = index;
+    sqe->user_data = index;
+    reader->in_flight++;
+}
+
+// Starts reading a block into a free buffer, the caller checks there is one
+static void reader_queue_block(reader_t* reader, const reader_block_t* block) {
+    const u32 index = reader->free_buffers[--reader->free_count];
+    reader->blocks[index] = *block;
+    reader_issue(reader, index);
+}
+
+static void reader_free(reader_t* reader, const u32 index) {
+    reader->free_buffers[reader->free_count++] = index;
+}
+
+// Ends a job that won't be analyzed, the same way finish_analysis() ends one that was
+static void reader_drop_job(const file_job_t* job, const i32 fd) {
+    drop_cached(fd, 0, 0);
+    close(fd);
+    if (job->fd != -1) {
+        atomic_fetch_add(&fd_budget, 1);
+    }
+    finish_job(job);
+}
+
+// The first block of a file holds its chunk headers and usually the start of the data
+static void reader_read_header(reader_t* reader, file_job_t* job) {
+    i32 fd = job->fd;
+    if (fd == -1 && (fd = open(job->path.start, O_RDONLY | O_CLOEXEC)) == -1) {
+        printf("Failed to open %s: %s\n", job->path.start, strerror(errno));
+        finish_job(job);
+        return;
+    }
+
+    // Where the filesystem doesn't do O_DIRECT this stays a buffered read
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+    expect_sequential(fd);
+
+    const u64 size = job->size < IO_BLOCK_SIZE ? job->size : IO_BLOCK_SIZE;
+    const reader_block_t block = { .job = job, .fd = fd, .size = align_size(size, IO_ALIGNMENT), .needed = size };
+    reader_queue_block(reader, &block);
+}
+
+// Reads the next range of the oldest pending file, from its warm-up on
+static void reader_read_range(reader_t* reader) {
+    file_analysis_t* analysis = reader->pending;
+    range_task_t* range = &analysis->ranges[analysis->next_range++];
+    if (analysis->next_range == analysis->range_count) {
+        reader->pending = analysis->next_pending;
+    }
+
+    const sample_layout_t* layout = &analysis->layout;
+    const u64 start = analysis->data_offset + range_warmup_start(range, layout) * layout->block_align;
+    const u64 end = analysis->data_offset + (range->first_frame + range->frame_count) * layout->block_align;
+    const u64 offset = start & ~(u64)(IO_ALIGNMENT - 1);
+    const reader_block_t block = {
+        .job = (file_job_t*)analysis->job,
+        .fd = analysis->fd,
+        .analysis = analysis,
+        .range = range,
+        .offset = offset,
+        .size = align_size(end - offset, IO_ALIGNMENT),
+        .needed = end - offset
+    };
+    reader_queue_block(reader, &block);
+}
+
+// Sets up a file's ranges once its first block is in. Frames wholly inside that block are the first range,
+// every other range is sized so it fits into a block together with its warm-up
+static void reader_start_file(reader_t* reader, const u32 index) {
+    note_job_start();
+
+    const reader_block_t* block = &reader->blocks[index];
+    file_job_t* job = block->job;
+    const i32 fd = block->fd;
+    u8* buffer = reader_buffer(reader, index);
+    const u64 available = block->done < job->size ? block->done : job->size;
+
+    wave_header_t header;
+    const header_status_t status = parse_header(buffer, available, job->size, job, &header, OUTPUT_STDIO);
+    if (status == HEADER_INVALID) {
+        reader_free(reader, index);
+        reader_drop_job(job, fd);
+        return;
+    }
+
+    sample_layout_t layout = { 0 };
+    const u64 frame_count = status == HEADER_OK ? layout_from_header(&header, &layout) : 0;
+    const u64 block_frames = layout.block_align > 0 ? (IO_BLOCK_SIZE - 2 * IO_ALIGNMENT) / layout.block_align : 0;
+    const u64 frames_per_range = block_frames > layout.hp_warmup_frames ? block_frames - layout.hp_warmup_frames : 0;
+
+    // Chunks past the first block, or a warm-up that would take up most of every block: measured from a mapping like with --io=mmap
+    if (status == HEADER_TRUNCATED || (frame_count > 0 && frames_per_range < layout.hp_warmup_frames)) {
+        reader_free(reader, index);
+        if (fd != job->fd) {
+            close(fd);
+        }
+        sched_submit(sched, &job->task);
+        return;
+    }
+
+    const u64 data_end = header.data_offset + header.data_size < available ? header.data_offset + header.data_size : available;
+    // No frames (unsupported layout, zero block_align) makes one empty range, same as the other engines
+    const u64 frames_in_block = frame_count > 0 && data_end > header.data_offset ? (data_end - header.data_offset) / layout.block_align : 0;
+    const bool first_in_block = frames_in_block > 0 || frame_count == 0;
+    const u64 first_range_frames = frames_in_block > 0 ? frames_in_block : frames_per_range;
+    const u64 remaining_frames = frame_count > first_range_frames ? frame_count - first_range_frames : 0;
+    const u32 range_count = 1 + (frames_per_range > 0 ? (remaining_frames + frames_per_range - 1) / frames_per_range : 0);
+
+    file_analysis_t* analysis = make_analysis(job, fd, NULL, &header, &layout, frame_count, range_count, first_range_frames, frames_per_range, NULL, OUTPUT_STDIO);
+    if (!analysis) {
+        reader_free(reader, index);
+        reader_drop_job(job, fd);
+        return;
+    }
+    analysis->reader = reader;
+
+    range_task_t* first = &analysis->ranges[0];
+    if (frames_in_block > 0) {
+        first->block = buffer + header.data_offset;
+        first->buffer_index = index;
+    } else {
+        reader_free(reader, index);
+    }
+
+    analysis->next_range = first_in_block ? 1 : 0;
+    if (analysis->next_range < range_count) {
+        if (reader->pending) {
+            reader->pending_tail->next_pending = analysis;
+        } else {
+            reader->pending = analysis;
+        }
+        reader->pending_tail = analysis;
+    }
+
+    // Last, the analysis may be finished and gone as soon as its ranges are all submitted
+    if (first_in_block) {
+        sched_submit(sched, &first->task);
+    }
+}
+
+static void reader_complete(reader_t* reader, const u32 index, const i32 result) {
+    reader_block_t* block = &reader->blocks[index];
+    const u64 done = reader_resume_offset(block) + (result > 0 ? result : 0);
+    if (done > block->done) {
+        block->done = done;
+        // Short reads only happen at the end of the file, so another one finds out whether it got shorter
+        if (block->done < block->needed) {
+            reader_issue(reader, index);
+            return;
+        }
+    }
+
+    if (block->done < block->needed && !block->analysis) {
+        printf("Failed to read %s: %s\n", block->job->path.start, result < 0 ? strerror(-result) : "file got shorter");
+        reader_free(reader, index);
+        reader_drop_job(block->job, block->fd);
+        return;
+    }
+
+    if (!block->analysis) {
+        reader_start_file(reader, index);
+        return;
+    }
+
+    // A range that couldn't be read gets another try with pread() in read_range(), which fails the file if that fails too
+    range_task_t* range = block->range;
+    if (block->done < block->needed) {
+        reader_free(reader, index);
+    } else {
+        const file_analysis_t* analysis = block->analysis;
+        const u64 start = analysis->data_offset + range_warmup_start(range, &analysis->layout) * analysis->layout.block_align;
+        range->block = reader_buffer(reader, index) + (start - block->offset);
+        range->buffer_index = index;
+    }
+    sched_submit(sched, &range->task);
+}
+
+// After io_uring_enter failed: takes back what wasn't submitted and waits for what was, so the kernel is done with
+// the buffers, then leaves every read this reader still owes to the workers. Headers go to run_file_job() like a
+// truncated one, ranges get read with pread() in read_range(), and jobs still queued follow the headers
+static void reader_fall_back(reader_t* reader) {
+    reader->in_flight -= uring_discard_unsubmitted(&reader->ring);
+    while (reader->in_flight > 0) {
+        const i32 result = uring_submit(&reader->ring, 1);
+        if (result < 0 && result != -EAGAIN && result != -EBUSY) {
+            break; // Tearing the ring down below cancels whatever is left
+        }
+        while (uring_peek_cqe(&reader->ring)) {
+            uring_cqe_seen(&reader->ring);
+            reader->in_flight--;
+        }
+    }
+    uring_exit(&reader->ring);
+
+    // Reads that did complete are thrown away too, the workers read them again
+    for (u32 i = 0; i < reader->buffer_count; i++) {
+        reader_block_t* block = &reader->blocks[i];
+        if (!block->reading) {
+            continue;
+        }
+        block->reading = false;
+        if (block->analysis) {
+            sched_submit(sched, &block->range->task);
+        } else {
+            if (block->fd != block->job->fd) {
+                close(block->fd);
+            }
+            sched_submit(sched, &block->job->task);
+        }
+    }
+
+    // A file is gone once its last range is measured, so everything needed from it is read before that's submitted
+    for (file_analysis_t* analysis = reader->pending; analysis;) {
+        file_analysis_t* next = analysis->next_pending;
+        range_task_t* ranges = analysis->ranges;
+        const u32 first = analysis->next_range;
+        const u32 range_count = analysis->range_count;
+        for (u32 i = first; i < range_count; i++) {
+            sched_submit(sched, &ranges[i].task);
+        }
+        analysis = next;
+    }
+    reader->pending = NULL;
+
+    file_job_t* job;
+    while (queue_pop(&readers.jobs, (void**)&job)) {
+        sched_submit(sched, &job->task);
+    }
+}
+
+static void* reader_thread_main(void* arg) {
+    reader_t* reader = arg;
+    bool jobs_open = true;
+
+    while (true) {
+        void* item;
+        while (queue_try_pop(&reader->returned, &item)) {
+            reader_free(reader, (u32)(uptr)item);
+        }
+
+        // Files already started get their ranges read before new ones are opened
+        while (reader->free_count > 0 && reader->in_flight < options.io_depth) {
+            file_job_t* job;
+            if (reader->pending) {
+                reader_read_range(reader);
+            } else if (!jobs_open) {
+                break;
+            } else if (reader->in_flight > 0) {
+                if (!queue_try_pop(&readers.jobs, (void**)&job)) {
+                    break;
+                }
+                reader_read_header(reader, job);
+            } else if (queue_pop(&readers.jobs, (void**)&job)) {
+                reader_read_header(reader, job);
+            } else {
+                jobs_open = false;
+            }
+        }
+
+        if (reader->in_flight == 0) {
+            if (!jobs_open && !reader->pending) {
+                break;
+            }
+            // Every buffer is with the workers
+            if (reader->free_count == 0 && queue_pop(&reader->returned, &item)) {
+                reader_free(reader, (u32)(uptr)item);
+            }
+            continue;
+        }
+
+        const i32 result = uring_submit(&reader->ring, 1);
+        if (result < 0 && result != -EAGAIN && result != -EBUSY) {
+            printf("io_uring_enter failed: %s, the workers read this reader's files from here on\n", strerror(-result));
+            reader_fall_back(reader);
+            break;
+        }
+
+        struct io_uring_cqe* cqe;
+        while ((cqe = uring_peek_cqe(&reader->ring))) {
+            const u32 index = cqe->user_data;
+            const i32 res = cqe->res;
+            uring_cqe_seen(&reader->ring);
+            reader->in_flight--;
+            reader->blocks[index].reading = false;
+            reader_complete(reader, index, res);
+        }
+    }
+
+    if (atomic_fetch_sub(&readers.running, 1) == 1) {
+        sched_close(sched);
+    }
+    return NULL;
+}
+
+// Each reader gets twice options.io_depth buffers, as workers hold on to some while measuring them.
+// Returns false if io_uring isn't available. Buffers that can't be registered are read into with plain IORING_OP_READ
+static bool readers_init(void) {
+    const u32 buffer_count = options.io_depth * 2;
+    const u8 opcodes[] = { IORING_OP_READ, IORING_OP_READ_FIXED };
+
+    readers.readers = arena_alloc_aligned(&arena_global, sizeof(reader_t) * options.io_threads, CACHE_LINE_SIZE);
+    if (!readers.readers) {
+        return false;
+    }
+    for (u32 i = 0; i < options.io_threads; i++) {
+        readers.readers[i] = (reader_t){ .ring = { .fd = -1 } };
+    }
+    if (!queue_init(&readers.jobs, &arena_global, FILE_QUEUE_CAPACITY)) {
+        return false;
+    }
+
+    for (u32 i = 0; i < options.io_threads; i++) {
+        reader_t* reader = &readers.readers[i];
+        if (!uring_init(&reader->ring, buffer_count) || !uring_supports(&reader->ring, opcodes, sizeof(opcodes))) {
+            return false;
+        }
+
+        reader->arena = arena_make((u64)IO_BLOCK_SIZE * buffer_count);
+        reader->blocks = arena_alloc(&arena_global, sizeof(reader_block_t) * buffer_count);
+        reader->free_buffers = arena_alloc(&arena_global, sizeof(u32) * buffer_count);
+        if (!arena_valid(&reader->arena) || !reader->blocks || !reader->free_buffers ||
+            !queue_init(&reader->returned, &arena_global, buffer_count)) {
+            return false;
+        }
+        reader->buffers = arena_alloc_aligned(&reader->arena, (u64)IO_BLOCK_SIZE * buffer_count, IO_ALIGNMENT);
+        reader->buffer_count = buffer_count;
+
+        struct iovec* iov = arena_alloc(&arena_temp, sizeof(struct iovec) * buffer_count);
+        for (u32 k = 0; k < buffer_count; k++) {
+            iov[k] = (struct iovec){ .iov_base = reader_buffer(reader, k), .iov_len = IO_BLOCK_SIZE };
+            reader->free_buffers[reader->free_count++] = buffer_count - 1 - k;
+        }
+        reader->fixed = uring_register_buffers(&reader->ring, iov, buffer_count);
+        arena_clear(&arena_temp);
+    }
+    return true;
+}
+
+static bool readers_start(void) {
+    atomic_store(&readers.running, options.io_threads);
+    for (u32 i = 0; i < options.io_threads; i++) {
+        if (pthread_create(&readers.readers[i].thread, NULL, reader_thread_main, &readers.readers[i]) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void readers_join(void) {
+    for (u32 i = 0; i < options.io_threads; i++) {
+        pthread_join(readers.readers[i].thread, NULL);
+    }
+}
+
+// After sched_join(), when no worker holds a buffer anymore. Also cleans up after a readers_init() that failed halfway
+static void readers_delete(void) {
+    for (u32 i = 0; readers.readers && i < options.io_threads; i++) {
+        uring_exit(&readers.readers[i].ring);
+        if (arena_valid(&readers.readers[i].arena)) {
+            arena_delete(&readers.readers[i].arena);
+        }
+    }
+}
+
+// Hands a job to the readers with --io=uring, otherwise to the prefetch stage or straight to the workers without one
+static void submit_job(file_job_t* job) {
+    if (options.io == IO_URING) {
+        queue_push(&readers.jobs, job);
+    } else if (options.prefetch_budget > 0) {
+        queue_push(&prefetch.queue, job);
+    } else {
+        sched_submit(sched, &job->task);
+    }
+}
+
+// After the last submit_job()
+static void close_submissions(void) {
+    if (options.io == IO_URING) {
+        queue_close(&readers.jobs);
+    } else if (options.prefetch_budget > 0) {
+        queue_close(&prefetch.queue);
+    } else {
+        sched_close(sched);
+    }
+}
+
+// Hill climbing over the number of active workers, between 1 and options.threads.
+// Every ADAPT_INTERVAL_MS it samples measured bytes/s and process CPU time. After settling it probes a step
+// towards more workers when they're mostly waiting on I/O or every ADAPT_UPWARD_PROBES probes, towards fewer
+// otherwise, keeps moving while throughput rises and steps back when it falls. Fewer workers for the same
+// throughput are kept, more aren't. Moves down are measured against the best rate seen with more workers,
+// so small losses can't add up over several of them
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t stop;
+    bool stopping;
+
+    u32 active;
+    u32 previous_active; // Before the move being evaluated
+    i32 direction;       // Of the move being evaluated, 0 while settled
+    u32 settled_intervals;
+    f64 previous_rate;   // Bytes/s before the move being evaluated
+    u32 probe_count;
+    u32 reference_active; // Workers the best rate before the moves down was seen with
+    f64 reference_rate;   // 0 without moves down since the last step back or gain from more workers
+    u32 cpu_count;       // CPU use is relative to the CPUs the active workers can actually occupy
+} adapt_t;
+
+static adapt_t adapt;
+
+static u64 process_cpu_ns(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ull + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ull;
+}
+
+static void adapt_move(const u32 active, const f64 rate, const f64 cpu, const c* reason) {
+    printf("Adaptive: %.1f MB/s, %.0f%% CPU use, %s, %u -> %u threads\n", rate / MB(1), cpu * 100, reason, adapt.active, active);
+    adapt.active = active;
+    sched_set_active(sched, active);
+}
+
+// Starts a move whose effect the next adapt_decide() evaluates
+static void adapt_probe(const u32 next, const i32 direction, const f64 rate, const f64 cpu, const c* reason) {
+    if (direction < 0 && rate >= adapt.reference_rate) {
+        adapt.reference_active = adapt.active;
+        adapt.reference_rate = rate;
+    }
+    adapt.previous_active = adapt.active;
+    adapt.previous_rate = rate;
+    adapt.direction = direction;
+    adapt_move(next, rate, cpu, reason);
+}
+
+static void adapt_decide(const f64 rate, const f64 cpu) {
+    const u32 step = adapt.active / 4 > 0 ? adapt.active / 4 : 1;
+
+    if (adapt.direction != 0) {
+        const i32 direction = adapt.direction;
+        adapt.direction = 0;
+        adapt.settled_intervals = 0;
+
+        if (rate > adapt.previous_rate * (1 + ADAPT_TOLERANCE)) {
+            // Worth it, keep going while there's room. More threads paying off makes the rates before stale
+            if (direction > 0) {
+                adapt.reference_rate = 0;
+            }
+            const u32 next = direction > 0 ? (adapt.active + step < options.threads ? adapt.active + step : options.threads)
+                                           : (adapt.active > step ? adapt.active - step : 1);
+            if (next != adapt.active) {
+                adapt_probe(next, direction, rate, cpu, "throughput rose");
+            }
+        } else if (direction < 0 && rate < adapt.reference_rate * (1 - ADAPT_TOLERANCE)) {
+            const u32 active = adapt.reference_active;
+            adapt.reference_rate = 0;
+            adapt_move(active, rate, cpu, "throughput fell below the best with more threads, going back");
+        } else if (rate < adapt.previous_rate * (1 - ADAPT_TOLERANCE)) {
+            adapt_move(adapt.previous_active, rate, cpu, "throughput fell, stepping back");
+        } else if (direction > 0) {
+            adapt_move(adapt.previous_active, rate, cpu, "no gain from more threads, stepping back");
+        } else {
+            printf("Adaptive: %.1f MB/s, %.0f%% CPU use, no loss with fewer threads, keeping %u\n", rate / MB(1), cpu * 100, adapt.active);
+        }
+        return;
+    }
+
+    if (++adapt.settled_intervals < ADAPT_SETTLE_INTERVALS) {
+        return;
+    }
+    adapt.settled_intervals = 0;
+
+    // Busy workers get the occasional probe up too, the files may have changed since more of them were given up.
+    // Fewer threads is the only probe left at the top
+    const bool io_bound = cpu < ADAPT_IO_BOUND_CPU;
+    const bool upward = adapt.active < options.threads && (io_bound || ++adapt.probe_count % ADAPT_UPWARD_PROBES == 0);
+    const u32 next = upward ? (adapt.active + step < options.threads ? adapt.active + step : options.threads)
+                            : (adapt.active > step ? adapt.active - step : 1);
+    if (next != adapt.active) {
+        adapt_probe(next, upward ? 1 : -1, rate, cpu, io_bound ? "waiting on I/O, probing more threads" : upward ? "probing more threads" : "probing fewer threads");
+    }
+}
+
+static void* adapt_thread_main(void* arg) {
+    u64 last_ns = now_ns();
+    u64 last_cpu_ns = process_cpu_ns();
+    u64 last_bytes = atomic_load(&measured_bytes);
+
+    pthread_mutex_lock(&adapt.mutex);
+    while (!adapt.stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += ADAPT_INTERVAL_MS * 1000000ll;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        if (pthread_cond_timedwait(&adapt.stop, &adapt.mutex, &deadline) != ETIMEDOUT) {
+            continue;
+        }
+
+        const u64 time_ns = now_ns();
+        const u64 cpu_ns = process_cpu_ns();
+        const u64 bytes = atomic_load(&measured_bytes);
+
+        // Nothing measured means nothing to measure yet (or any more), which says nothing about the thread count
+        if (bytes > last_bytes) {
+            const f64 seconds = (time_ns - last_ns) / 1e9;
+            adapt_decide((bytes - last_bytes) / seconds, (cpu_ns - last_cpu_ns) / 1e9 / seconds / (adapt.active < adapt.cpu_count ? adapt.active : adapt.cpu_count));
+        }
+        last_ns = time_ns;
+        last_cpu_ns = cpu_ns;
+        last_bytes = bytes;
+    }
+    pthread_mutex_unlock(&adapt.mutex);
+    return NULL;
+}
+
+static bool adapt_start(void) {
+    adapt.active = options.threads;
+    adapt.cpu_count = CPU_COUNT(&topo.allowed) > 0 ? CPU_COUNT(&topo.allowed) : 1;
+    pthread_mutex_init(&adapt.mutex, NULL);
+    pthread_cond_init(&adapt.stop, NULL);
+    return pthread_create(&adapt.thread, NULL, adapt_thread_main, NULL) == 0;
+}
+
+static void adapt_stop(void) {
+    pthread_mutex_lock(&adapt.mutex);
+    adapt.stopping = true;
+    pthread_cond_signal(&adapt.stop);
+    pthread_mutex_unlock(&adapt.mutex);
+    pthread_join(adapt.thread, NULL);
+}
+
+// With --size-window a full window releases its largest job for every job that comes in
+static void dispatch_job(discover_t* discover, file_job_t* job) {
+    if (options.size_window == 0) {
+        submit_job(job);
+        return;
+    }
+    window_push(discover, job);
+    if (discover->window_count == options.size_window) {
+        submit_job(window_pop(discover));
+    }
+}
+
+// Dispatches everything left in the window, largest first
+static void drain_window(discover_t* discover) {
+    while (discover->window_count > 0) {
+        submit_job(window_pop(discover));
+    }
+}
+
+static void add_alias(file_job_t* job, file_alias_t* alias) {
+    file_alias_t* head = atomic_load(&job->aliases);
+    do {
+        alias->next = head;
+    } while (!atomic_compare_exchange_weak(&job->aliases, &head, alias));
+
+    if (head == NULL) {
+        file_job_t* aliased_head = atomic_load(&aliased_jobs);
+        do {
+            job->next_aliased = aliased_head;
+        } while (!atomic_compare_exchange_weak(&aliased_jobs, &aliased_head, job));
+    }
+}
+
+// Filters a batch of files down to WAVs and queues them.
+// Candidates are stat()'ed in one batch, then files whose (dev, ino) was already seen become aliases
+// of the first job for that inode, and the rest are opened ahead of processing in one batch if the fd budget allows.
+// count is at most WALK_BATCH_SIZE
+static void discover_files(discover_t* discover, const walk_entry_t* files, const u64 count) {
+    meta_op_t* ops = discover->ops;
+    u64 candidate_count = 0;
+    for (u64 i = 0; i < count; i++) {
+        if (!has_wav_extension(files[i].path)) {
+            continue;
+        }
+        discover->candidates[candidate_count] = &files[i];
+        ops[candidate_count] = (meta_op_t){ .dir_fd = files[i].dir_fd, .name = files[i].name, .fd = -1 };
+        candidate_count++;
+    }
+
+    if (candidate_count < count) {
+        atomic_fetch_add(&rejected_by_extension, count - candidate_count);
+    }
+    if (candidate_count == 0) {
+        return;
+    }
+
+    meta_run(&discover->meta, ops, candidate_count, META_STATX);
+
+    u64 unique_count = 0;
+    for (u64 i = 0; i < candidate_count; i++) {
+        const walk_entry_t* file = discover->candidates[i];
+        const meta_op_t* op = &ops[i];
+
+        if (op->stat_result != 0) {
+            printf("Failed to get stats for path: %s\n", file->path.start);
+            continue;
+        }
+        if (!S_ISREG(op->stx.stx_mode)) {
+            continue;
+        }
+
+        file_job_t* job = arena_alloc(file->arena, sizeof(file_job_t));
+        if (!job) {
+            printf("Walk arena is full, skipping: %s\n", file->path.start);
+            continue;
+        }
+        *job = (file_job_t){
+            .task = { .run = options.probe ? run_probe_job : run_file_job },
+            .path = file->path,
+            .fd = -1,
+            .size = op->stx.stx_size,
+            .dev = makedev(op->stx.stx_dev_major, op->stx.stx_dev_minor),
+            .ino = op->stx.stx_ino,
+            .mtime_ns = op->stx.stx_mtime.tv_sec * 1000000000ll + op->stx.stx_mtime.tv_nsec,
+            .watch_batch = discover->watch_batch
+        };
+        atomic_init(&job->aliases, NULL);
+
+        if (options.dedup && !discover->rescan) {
+            file_job_t* existing = inode_set_insert(&inode_set, job->dev, job->ino, job);
+            if (existing) {
+                file_alias_t* alias = arena_alloc(file->arena, sizeof(file_alias_t));
+                if (alias) {
+                    alias->path = file->path;
+                    add_alias(existing, alias);
+                }
+                continue;
+            }
+        }
+
+        if (options.index_path) {
+            const file_index_key_t key = job_index_key(job);
+            const file_result_t* indexed = file_index_find(&file_index, &key);
+            if (indexed) {
+                print_result(OUTPUT_STDIO, job->path, indexed);
+                atomic_fetch_add(&index_hits, 1);
+                continue;
+            }
+        }
+
+        if (unique_count != i) {
+            ops[unique_count] = ops[i];
+            discover->candidates[unique_count] = file;
+        }
+        discover->jobs[unique_count] = job;
+        unique_count++;
+    }
+
+    if (unique_count == 0) {
+        return;
+    }
+
+    const bool open_ahead = fd_budget_acquire(unique_count);
+    if (open_ahead) {
+        meta_run(&discover->meta, ops, unique_count, META_OPEN);
+    }
+
+    u64 unused_fds = 0;
+    u64 rejected = 0;
+    for (u64 i = 0; i < unique_count; i++) {
+        const walk_entry_t* file = discover->candidates[i];
+        const meta_op_t* op = &ops[i];
+        file_job_t* job = discover->jobs[i];
+
+        i32 fd = open_ahead ? op->fd : openat(file->dir_fd, file->name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            printf("Failed to open file: %s\n", file->path.start);
+            unused_fds += open_ahead ? 1 : 0;
+            job->rejected = true;
+            continue;
+        }
+
+        if (!has_wav_header(fd)) {
+            rejected++;
+            job->rejected = true;
+            drop_cached(fd, 0, 0);
+            close(fd);
+            unused_fds += open_ahead ? 1 : 0;
+            continue;
+        }
+
+        if (options.order != ORDER_DISCOVERY) {
+            job->order_key = file_order_key(fd, job->ino);
+        }
+
+        // Only fds from the budget are kept, and sorted jobs can't hold on to theirs until the whole batch is known
+        if (!open_ahead || options.order != ORDER_DISCOVERY) {
+            close(fd);
+            unused_fds += open_ahead ? 1 : 0;
+            fd = -1;
+        }
+        job->fd = fd;
+
+        if (options.order != ORDER_DISCOVERY) {
+            job->next = discover->collected;
+            discover->collected = job;
+            discover->collected_count++;
+        } else {
+            if (job->watch_batch) {
+                atomic_fetch_add(&job->watch_batch->pending, 1);
+            }
+            dispatch_job(discover, job);
+        }
+    }
+
+    if (unused_fds > 0) {
+        atomic_fetch_add(&fd_budget, unused_fds);
+    }
+    if (rejected > 0) {
+        atomic_fetch_add(&rejected_by_header, rejected);
+    }
+}
+
+// Aliases of a job rejected by its header weren't analyzed either, so they're left out of the count too
+static void print_aliases(void) {
+    u64 alias_count = 0;
+    for (file_job_t* job = atomic_load(&aliased_jobs); job; job = job->next_aliased) {
+        if (job->rejected) {
+            continue;
+        }
+        for (file_alias_t* alias = atomic_load(&job->aliases); alias; alias = alias->next) {
+            alias_count++;
+        }
+    }
+    if (alias_count == 0) {
+        return;
+    }
+
+    printf("Analyzed once for %lu additional hard-linked or bind-mounted paths:\n", alias_count);
+    for (file_job_t* job = atomic_load(&aliased_jobs); job; job = job->next_aliased) {
+        if (job->rejected) {
+            continue;
+        }
+        printf("%s\n", job->path.start);
+        for (file_alias_t* alias = atomic_load(&job->aliases); alias; alias = alias->next) {
+            printf("    = %s\n", alias->path.start);
+        }
+    }
+}
+
+// Runs on walk threads
+static void on_files_found(void* user, const walk_entry_t* files, const u64 count) {
+    discover_files(&walk_discoverers[files[0].thread_index], files, count);
+}
+
+// In ordered modes main submits the sorted jobs once every source is done
+static void source_done(void) {
+    if (atomic_fetch_sub(&active_sources, 1) == 1 && options.order == ORDER_DISCOVERY) {
+        close_submissions();
+    }
+}
+
+// Runs on the last walk thread, the others are done with their discoverers
+static void on_walk_done(void* user) {
+    for (u32 i = 0; i < options.walk_threads; i++) {
+        drain_window(&walk_discoverers[i]);
+    }
+    source_done();
+}
+
+typedef struct {
+    pthread_t thread;
+    i32 fd;
+    arena_t arena;
+    discover_t discover;
+    walk_entry_t* batch;
+    u64 batch_count;
+} file_list_t;
+
+static void file_list_flush(file_list_t* list) {
+    if (list->batch_count > 0) {
+        discover_files(&list->discover, list->batch, list->batch_count);
+        list->batch_count = 0;
+    }
+}
+
+static void file_list_add(file_list_t* list, const c* path, const u64 length) {
+    if (length == 0) {
+        return;
+    }
+
+    str_t path_copy = str_from_size(&list->arena, length + 1);
+    if (!str_valid(&path_copy)) {
+        printf("File list arena is full, skipping: %.*s\n", (int)length, path);
+        return;
+    }
+    memcpy(path_copy.start, path, length);
+    path_copy.start[length] = '\0';
+    path_copy.length = path_copy.capacity = length;
+
+    list->batch[list->batch_count++] = (walk_entry_t){
+        .path = path_copy,
+        .name = path_copy.start,
+        .dir_fd = AT_FDCWD,
+        .type = DT_REG,
+        .arena = &list->arena
+    };
+    if (list->batch_count == WALK_BATCH_SIZE) {
+        file_list_flush(list);
+    }
+}
+
+// Streams NUL- or newline-separated paths into discovery as they arrive.
+// The separator is NUL if the first read contains one, newline otherwise.
+// Paths are used as given, relative ones resolve against the working directory
+static void* file_list_thread_main(void* arg) {
+    file_list_t* list = arg;
+
+    c* buffer = arena_alloc(&list->arena, FILE_LIST_BUFFER_SIZE);
+    u64 buffered = 0;
+    c separator = 0;
+    bool first_read = true;
+
+    while (true) {
+        // Whatever is complete goes out before a potentially blocking read
+        file_list_flush(list);
+
+        const ssize_t result = read(list->fd, buffer + buffered, FILE_LIST_BUFFER_SIZE - buffered);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0) {
+            printf("Failed to read the file list: %s\n", strerror(errno));
+            break;
+        }
+        if (result == 0) {
+            file_list_add(list, buffer, buffered);
+            break;
+        }
+
+        if (first_read) {
+            separator = memchr(buffer, '\0', result) ? '\0' : '\n';
+            first_read = false;
+        }
+
+        const u64 end = buffered + result;
+        u64 start = 0;
+        for (u64 i = buffered; i < end; i++) {
+            if (buffer[i] == separator) {
+                file_list_add(list, buffer + start, i - start);
+                start = i + 1;
+            }
+        }
+
+        buffered = end - start;
+        if (buffered == FILE_LIST_BUFFER_SIZE) {
+            printf("Path in the file list is too long, skipping: %.64s...\n", buffer);
+            buffered = 0;
+        } else {
+            memmove(buffer, buffer + start, buffered);
+        }
+    }
+
+    file_list_flush(list);
+    drain_window(&list->discover);
+    if (list->fd != STDIN_FILENO) {
+        close(list->fd);
+    }
+    source_done();
+    return NULL;
+}
+
+static bool file_list_start(file_list_t* list, const c* path) {
+    list->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    if (list->fd == -1) {
+        printf("Failed to open the file list: %s\n", path);
+        return false;
+    }
+
+    list->arena = arena_make(FILE_LIST_ARENA_SIZE);
+    if (!arena_valid(&list->arena) || !discover_init(&list->discover, &list->arena)) {
+        return false;
+    }
+    list->batch = arena_alloc(&list->arena, sizeof(walk_entry_t) * WALK_BATCH_SIZE);
+    list->batch_count = 0;
+    if (!list->batch) {
+        return false;
+    }
+
+    return pthread_create(&list->thread, NULL, file_list_thread_main, list) == 0;
+}
+
+typedef struct watch_dir_t watch_dir_t;
+struct watch_dir_t {
+    str_t path;
+    watch_dir_t* next;
+};
+
+typedef struct {
+    pthread_t thread;
+    i32 inotify_fd;
+    i32 signal_fd;
+    arena_t arena; // Lives as long as the watch
+    discover_t discover;
+    walk_entry_t* batch;
+    u64 batch_count;
+    watch_batch_t* batch_owner;  // Holding the paths in batch, NULL until the first one
+    watch_batch_t* free_batches;
+    watch_dir_t* free_dirs;
+    dir_reader_t reader;
+    str_t* dir_paths; // Indexed by watch descriptor
+    u64 dir_path_capacity;
+    bool out_of_watches;
+} watcher_t;
+
+static void watcher_flush(watcher_t* watcher) {
+    if (watcher->batch_count > 0) {
+        watcher->discover.watch_batch = watcher->batch_owner;
+        discover_files(&watcher->discover, watcher->batch, watcher->batch_count);
+        watcher->batch_count = 0;
+    }
+    // Every job has its own hold by now, dropping the watcher's makes the batch reusable once they're done
+    if (watcher->batch_owner) {
+        watch_batch_release(watcher->batch_owner);
+        watcher->batch_owner = NULL;
+    }
+}
+
+// Reuses a batch whose jobs are all done, or makes a new one
+static watch_batch_t* watcher_take_batch(watcher_t* watcher) {
+    if (!watcher->free_batches) {
+        watcher->free_batches = atomic_exchange(&finished_watch_batches, NULL);
+    }
+    watch_batch_t* batch = watcher->free_batches;
+    if (batch) {
+        watcher->free_batches = batch->next;
+        arena_clear(&batch->arena);
+    } else {
+        batch = arena_alloc(&watcher->arena, sizeof(watch_batch_t));
+        if (!batch) {
+            return NULL;
+        }
+        batch->arena = arena_make(WATCH_BATCH_ARENA_SIZE);
+        if (!arena_valid(&batch->arena)) {
+            return NULL;
+        }
+    }
+    atomic_store(&batch->pending, 1);
+    batch->next = NULL;
+    return batch;
+}
+
+// Copies dir_path + "/" + name (or just dir_path) NUL-terminated into arena
+static str_t watcher_path(arena_t* arena, const str_t dir_path, const c* name, const u64 name_length) {
+    const u64 length = dir_path.length + (name ? 1 + name_length : 0);
+    str_t path = str_from_size(arena, length + 1);
+    if (!str_valid(&path)) {
+        return path;
+    }
+    memcpy(path.start, dir_path.start, dir_path.length);
+    if (name) {
+        path.start[dir_path.length] = '/';
+        memcpy(path.start + dir_path.length + 1, name, name_length);
+    }
+    path.start[length] = '\0';
+    path.length = path.capacity = length;
+    return path;
+}
+
+// Queues dir_path + "/" + name, its path and job go into the current batch
+static void watcher_add_file(watcher_t* watcher, const str_t dir_path, const c* name, const u64 name_length) {
+    if (!watcher->batch_owner && !(watcher->batch_owner = watcher_take_batch(watcher))) {
+        printf("Failed to allocate a watch batch, skipping: %.*s/%s\n", (int)dir_path.length, dir_path.start, name);
+        return;
+    }
+    const str_t path = watcher_path(&watcher->batch_owner->arena, dir_path, name, name_length);
+    if (!str_valid(&path)) {
+        printf("Path too long, skipping: %.*s/%s\n", (int)dir_path.length, dir_path.start, name);
+        return;
+    }
+
+    watcher->batch[watcher->batch_count++] = (walk_entry_t){
+        .path = path,
+        .name = path.start,
+        .dir_fd = AT_FDCWD,
+        .type = DT_REG,
+        .arena = &watcher->batch_owner->arena
+    };
+    if (watcher->batch_count == WALK_BATCH_SIZE) {
+        watcher_flush(watcher);
+    }
+}
+
+// Stack nodes of watcher_add_tree() are reused, only the directory paths stay
+static watch_dir_t* watcher_push_dir(watcher_t* watcher, watch_dir_t* next, const str_t path) {
+    watch_dir_t* dir = watcher->free_dirs;
+    if (dir) {
+        watcher->free_dirs = dir->next;
+    } else if (!(dir = arena_alloc(&watcher->arena, sizeof(watch_dir_t)))) {
+        return next;
+    }
+    *dir = (watch_dir_t){ .path = path, .next = next };
+    return dir;
+}
+
+static bool watcher_set_dir_path(watcher_t* watcher, const i32 wd, const str_t path) {
+    if ((u64)wd >= watcher->dir_path_capacity) {
+        u64 capacity = watcher->dir_path_capacity ? watcher->dir_path_capacity : 1024;
+        while (capacity <= (u64)wd) {
+            capacity *= 2;
+        }
+        str_t* dir_paths = arena_alloc(&watcher->arena, sizeof(str_t) * capacity);
+        if (!dir_paths) {
+            return false;
+        }
+        memset(dir_paths, 0, sizeof(str_t) * capacity);
+        if (watcher->dir_paths) {
+            memcpy(dir_paths, watcher->dir_paths, sizeof(str_t) * watcher->dir_path_capacity);
+        }
+        watcher->dir_paths = dir_paths;
+        watcher->dir_path_capacity = capacity;
+    }
+    watcher->dir_paths[wd] = path;
+    return true;
+}
+
+// Watches root and every directory below it. With report_files, regular files already inside
+// are reported too, for directories that appeared after their parent was being watched
+static void watcher_add_tree(watcher_t* watcher, const str_t root, const bool report_files) {
+    watch_dir_t* stack = watcher_push_dir(watcher, NULL, root);
+
+    while (stack) {
+        watch_dir_t* dir = stack;
+        const str_t dir_path = dir->path;
+        stack = dir->next;
+        dir->next = watcher->free_dirs;
+        watcher->free_dirs = dir;
+
+        const i32 wd = inotify_add_watch(watcher->inotify_fd, dir_path.start, WATCH_DIR_MASK);
+        if (wd == -1) {
+            if (errno == ENOSPC && !watcher->out_of_watches) {
+                printf("Out of inotify watches, raise fs.inotify.max_user_watches\n");
+                watcher->out_of_watches = true;
+            } else if (errno != ENOSPC && errno != ENOTDIR) {
+                printf("Failed to watch directory: %s\n", dir_path.start);
+            }
+            continue;
+        }
+        if (!watcher_set_dir_path(watcher, wd, dir_path)) {
+            printf("Watch arena is full, skipping: %s\n", dir_path.start);
+            continue;
+        }
+
+        const i32 dir_fd = open(dir_path.start, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dir_fd == -1) {
+            continue;
+        }
+
+        dir_reader_open(&watcher->reader, dir_fd);
+        dir_entry_t entry;
+        while (dir_next(&watcher->reader, &entry)) {
+            if (entry.name.start[0] == '.' || (entry.type != DT_DIR && (entry.type != DT_REG || !report_files))) {
+                continue;
+            }
+            if (entry.type == DT_REG) {
+                watcher_add_file(watcher, dir_path, entry.name.start, entry.name.length);
+                continue;
+            }
+            const str_t path = watcher_path(&watcher->arena, dir_path, entry.name.start, entry.name.length);
+            if (!str_valid(&path)) {
+                printf("Watch arena is full, skipping: %s/%s\n", dir_path.start, entry.name.start);
+                continue;
+            }
+            stack = watcher_push_dir(watcher, stack, path);
+        }
+        close(dir_fd);
+    }
+}
+
+static void watcher_handle_events(watcher_t* watcher, const u8* buffer, const u64 length) {
+    const struct inotify_event* event;
+    for (u64 offset = 0; offset < length; offset += sizeof(struct inotify_event) + event->len) {
+        event = (const struct inotify_event*)(buffer + offset);
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            printf("Watch event queue overflowed, some files were missed\n");
+            continue;
+        }
+        if (event->mask & IN_IGNORED) {
+            if ((u64)event->wd < watcher->dir_path_capacity) {
+                watcher->dir_paths[event->wd] = (str_t){ 0 };
+            }
+            continue;
+        }
+        if (event->len == 0 || event->name[0] == '.' || (u64)event->wd >= watcher->dir_path_capacity) {
+            continue;
+        }
+
+        const str_t dir_path = watcher->dir_paths[event->wd];
+        if (!dir_path.start) {
+            continue;
+        }
+
+        if (event->mask & IN_ISDIR) {
+            if (!(event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                continue;
+            }
+            const str_t path = watcher_path(&watcher->arena, dir_path, event->name, strlen(event->name));
+            if (!str_valid(&path)) {
+                printf("Watch arena is full, skipping: %.*s/%s\n", (int)dir_path.length, dir_path.start, event->name);
+                continue;
+            }
+            watcher_add_tree(watcher, path, true);
+        } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+            watcher_add_file(watcher, dir_path, event->name, strlen(event->name));
+        }
+    }
+}
+
+// Runs until SIGINT or SIGTERM
+static void* watcher_thread_main(void* arg) {
+    watcher_t* watcher = arg;
+
+    u8* buffer = arena_alloc_aligned(&watcher->arena, WATCH_EVENT_BUFFER_SIZE, 8);
+
+    struct pollfd fds[2] = {
+        { .fd = watcher->inotify_fd, .events = POLLIN },
+        { .fd = watcher->signal_fd, .events = POLLIN }
+    };
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Failed to wait for watch events: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        const ssize_t length = read(watcher->inotify_fd, buffer, WATCH_EVENT_BUFFER_SIZE);
+        if (length < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            printf("Failed to read watch events: %s\n", strerror(errno));
+            break;
+        }
+
+        watcher_handle_events(watcher, buffer, length);
+        watcher_flush(watcher);
+        // Events only reorder within what arrived together, nothing waits for the next event
+        drain_window(&watcher->discover);
+    }
+
+    watcher_flush(watcher);
+    drain_window(&watcher->discover);
+    close(watcher->inotify_fd);
+    close(watcher->signal_fd);
+    source_done();
+    return NULL;
+}
+
+// SIGINT and SIGTERM must already be blocked in every thread, the watcher picks them up through a signalfd
+static bool watcher_start(watcher_t* watcher, const str_t* roots, const u64 root_count, const sigset_t* stop_signals) {
+    watcher->arena = arena_make(WATCH_ARENA_SIZE);
+    if (!arena_valid(&watcher->arena) || !discover_init(&watcher->discover, &watcher->arena)) {
+        return false;
+    }
+    watcher->discover.rescan = true;
+    watcher->batch = arena_alloc(&watcher->arena, sizeof(walk_entry_t) * WALK_BATCH_SIZE);
+    if (!watcher->batch || !dir_reader_init(&watcher->reader, &watcher->arena, options.dir_buffer_size)) {
+        return false;
+    }
+
+    watcher->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    watcher->signal_fd = signalfd(-1, stop_signals, SFD_CLOEXEC);
+    if (watcher->inotify_fd == -1 || watcher->signal_fd == -1) {
+        return false;
+    }
+
+    for (u64 i = 0; i < root_count; i++) {
+        const str_t root = watcher_path(&watcher->arena, roots[i], NULL, 0);
+        if (str_valid(&root)) {
+            watcher_add_tree(watcher, root, false);
+        }
+    }
+
+    return pthread_create(&watcher->thread, NULL, watcher_thread_main, watcher) == 0;
+}
+
+// Returns ceil(quota / period) from cgroup v2 cpu.max or cgroup v1 cfs_quota_us/cfs_period_us, 0 if unlimited
+static u32 cgroup_cpu_limit(void) {
+    c cgroup[PATH_MAX] = "";
+    FILE* file = fopen("/proc/self/cgroup", "r");
+    if (file) {
+        c line[PATH_MAX];
+        while (fgets(line, sizeof(line), file)) {
+            if (strncmp(line, "0::", 3) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                snprintf(cgroup, sizeof(cgroup), "%s", line + 3);
+                break;
+            }
+        }
+        fclose(file);
+    }
+
+    i64 quota = -1;
+    i64 period = 0;
+
+    // The own cgroup first, then the namespace root which is what a container usually sees
+    c path[PATH_MAX + 32];
+    const c* const v2_paths[] = { cgroup, "" };
+    for (u32 i = 0; i < 2 && quota < 0; i++) {
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", strcmp(v2_paths[i], "/") == 0 ? "" : v2_paths[i]);
+        file = fopen(path, "r");
+        if (file) {
+            c max[32];
+            if (fscanf(file, "%31s %ld", max, &period) == 2 && strcmp(max, "max") != 0) {
+                quota = strtol(max, NULL, 10);
+            }
+            fclose(file);
+            break;
+        }
+    }
+
+    if (quota < 0 && (file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r"))) {
+        if (fscanf(file, "%ld", &quota) != 1) {
+            quota = -1;
+        }
+        fclose(file);
+        if (quota > 0 && (file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r"))) {
+            if (fscanf(file, "%ld", &period) != 1) {
+                period = 0;
+            }
+            fclose(file);
+        }
+    }
+
+    if (quota <= 0 || period <= 0) {
+        return 0;
+    }
+    return (quota + period - 1) / period;
+}
+
+// Physical cores (or with --pinning other than cores, CPUs) this process may run on, capped by the cgroup CPU quota
+static u32 default_thread_count(void) {
+    u32 count = options.pinning == PINNING_CORES ? topo.core_count : CPU_COUNT(&topo.allowed);
+    if (count == 0) {
+        const long online = sysconf(_SC_NPROCESSORS_ONLN);
+        count = online > 0 ? online : 1;
+    }
+
+    const u32 limit = cgroup_cpu_limit();
+    if (limit > 0 && limit < count) {
+        count = limit;
+    }
+    return count;
+}
+
+static void print_usage(const c* program) {
+    printf("Usage: %s [options] [<path>...]\n"
+           "  --threads=N            Number of analysis threads (default: %u, see --pinning, capped by cgroup cpu.max)\n"
+           "  --pinning=MODE         cores (default): one analysis thread per physical core, each pinned to its own core,\n"
+           "                         traversal and prefetch threads on the SMT siblings and other CPUs left over\n"
+           "                         threads: one analysis thread per hardware thread, each pinned to its own CPU\n"
+           "                         off: one analysis thread per CPU, none pinned\n"
+           "  --walk-threads=N       Number of directory traversal threads (default: %u)\n"
+           "  --dir-buffer=BYTES     getdents64 buffer size per traversal thread (default: %lu)\n"
+           "  --meta-depth=N         statx/openat operations kept in flight per traversal thread (default: %u)\n"
+           "  --no-uring             Issue statx/openat synchronously instead of through io_uring\n"
+           "  --files-from=FILE      Also analyze the NUL- or newline-separated paths in FILE, \"-\" reads stdin\n"
+           "  --order=MODE           discovery (default): process files as they're found\n"
+           "                         physical: collect all files first, process by first extent on disk (FIEMAP)\n"
+           "                         inode: collect all files first, process by inode number\n"
+           "                         size: collect all files first, process largest first\n"
+           "  --size-window=N        With --order=discovery, hold back up to N files per traversal thread\n"
+           "                         and always dispatch the largest of them (default: 0, off)\n"
+           "  --split-threshold=SIZE Measure data chunks of at least SIZE bytes in ranges on several threads,\n"
+           "                         0 never splits (default: %lu)\n"
+           "  --prefetch=SIZE        Read data chunks into the page cache ahead of the analysis threads,\n"
+           "                         up to SIZE bytes ahead, 0 disables (default: %lu)\n"
+           "  --adaptive             Adjust the number of active analysis threads (up to --threads) to the measured\n"
+           "                         throughput, raise --threads above the core count for network storage\n"
+           "  --io=MODE              How analysis threads read sample data\n"
+           "                         mmap (default): map the file\n"
+           "                         populate: map the file with MAP_POPULATE, faulting all of it in up front\n"
+           "                         pread: read the data chunk in aligned blocks into a buffer per thread\n"
+           "                         direct: like pread but with O_DIRECT, bypassing the page cache (turns off --prefetch)\n"
+           "                         uring: O_DIRECT reads through io_uring into registered buffers, kept in flight across\n"
+           "                         files by --io-threads reader threads, each block measured once it's in (turns off --prefetch)\n"
+           "  --io-depth=N           Reads in flight per reader thread with --io=uring, a power of two (default: %u)\n"
+           "  --io-threads=N         Reader threads with --io=uring (default: %u)\n"
+           "  --probe                Only read chunk headers, with small reads that skip over sample data, and print\n"
+           "                         the format, duration and chunk directory of every file (ignores --io and --prefetch)\n"
+           "  --no-cache-pollution   Read files with FADV_SEQUENTIAL and drop their pages from the page cache as soon as\n"
+           "                         they're measured, including pages other processes had cached, then report how\n"
+           "                         much the (system-wide) page cache changed over the run\n"
+           "  --scratch-limit=SIZE   Scratch memory each analysis thread keeps between files (default: %lu)\n"
+           "  --numa                 Pin analysis threads to NUMA nodes in groups, keep their memory node-local\n"
+           "                         and, with --prefetch, hand files to the node whose page cache holds them\n"
+           "  --no-dedup             Analyze every hard link of a file instead of once per (device, inode)\n"
+           "  --index=FILE           Reuse results from FILE for files with unchanged (device, inode, size, mtime),\n"
+           "                         and append new results to it\n"
+           "  --index-compact        Drop superseded records from the index before scanning\n"
+           "  --watch                After the initial scan, keep analyzing files as they're written or moved\n"
+           "                         into the argument directories, until SIGINT or SIGTERM\n",
+           program, default_thread_count(), options.walk_threads, options.dir_buffer_size, options.meta_depth, options.split_threshold, options.prefetch_budget, options.io_depth, options.io_threads, options.scratch_limit);
+}
+
+// Returns the value of "--name=value" if arg is that option, NULL otherwise
+static const c* option_value(const c* arg, const c* name) {
+    const size_t name_length = strlen(name);
+    if (strncmp(arg, name, name_length) != 0 || arg[name_length] != '=') {
+        return NULL;
+    }
+    return arg + name_length + 1;
+}
+
+static u64 parse_u64_option(const c* name, const c* value, const u64 min, const u64 max) {
+    c* end = NULL;
+    errno = 0;
+    const u64 result = strtoull(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || result < min || result > max) {
+        printf("Invalid value for %s: \"%s\"\n", name, value);
+        exit(1);
+    }
+    return result;
+}
+
+// Accepts an optional K/M/G suffix
+static u64 parse_size_option(const c* name, const c* value, const u64 min, const u64 max) {
+    c* end = NULL;
+    errno = 0;
+    u64 result = strtoull(value, &end, 10);
+    if (errno == 0 && end != value) {
+        switch (*end) {
+        case 'K':
+        case 'k':
+            result = KB(result), end++;
+            break;
+        case 'M':
+        case 'm':
+            result = MB(result), end++;
+            break;
+        case 'G':
+        case 'g':
+            result = GB(result), end++;
+            break;
+        default:
+            break;
+        }
+    }
+    if (errno != 0 || end == value || *end != '\0' || result < min || result > max) {
+        printf("Invalid value for %s: \"%s\"\n", name, value);
+        exit(1);
+    }
+    return result;
+}
+
+int main(const int argc, char* argv[]) {
+    topo_discover(&topo);
+
+    if (argc < 2) {
+        printf("%s\n", "Please supply at least one argument.");
+        print_usage(argv[0]);
+        exit(1);
+    }
+
+    arena_global = arena_make(GB(1));
+
+    arena_temp = arena_make(MB(4));
+
+    str_t* paths = array_from_size(str_t, &arena_global, argc - 1);
+    char* absolute_path_buffer = arena_alloc(&arena_temp, PATH_MAX);
+
+    for (u64 i = 1; i < argc; i++) {
+        const c* value;
+        if ((value = option_value(argv[i], "--threads"))) {
+            options.threads = parse_u64_option("--threads", value, 1, 1024);
+        } else if ((value = option_value(argv[i], "--pinning"))) {
+            if (strcmp(value, "cores") == 0) {
+                options.pinning = PINNING_CORES;
+            } else if (strcmp(value, "threads") == 0) {
+                options.pinning = PINNING_THREADS;
+            } else if (strcmp(value, "off") == 0) {
+                options.pinning = PINNING_OFF;
+            } else {
+                printf("Invalid value for --pinning: \"%s\"\n", value);
+                exit(1);
+            }
+        } else if ((value = option_value(argv[i], "--walk-threads"))) {
+            options.walk_threads = parse_u64_option("--walk-threads", value, 1, 1024);
+        } else if ((value = option_value(argv[i], "--dir-buffer"))) {
+            options.dir_buffer_size = parse_size_option("--dir-buffer", value, KB(32), MB(64));
+        } else if ((value = option_value(argv[i], "--meta-depth"))) {
+            options.meta_depth = parse_u64_option("--meta-depth", value, 2, 4096);
+            if (!is_power_of_two(options.meta_depth)) {
+                printf("--meta-depth must be a power of two\n");
+                exit(1);
+            }
+        } else if ((value = option_value(argv[i], "--size-window"))) {
+            options.size_window = parse_u64_option("--size-window", value, 0, 1 << 20);
+        } else if ((value = option_value(argv[i], "--split-threshold"))) {
+            options.split_threshold = parse_size_option("--split-threshold", value, 0, GB(1024));
+        } else if ((value = option_value(argv[i], "--scratch-limit"))) {
+            options.scratch_limit = parse_size_option("--scratch-limit", value, 0, WORKER_SCRATCH_SIZE);
+        } else if ((value = option_value(argv[i], "--prefetch"))) {
+            options.prefetch_budget = parse_size_option("--prefetch", value, 0, GB(1024));
+        } else if ((value = option_value(argv[i], "--files-from"))) {
+            options.files_from = value;
+        } else if ((value = option_value(argv[i], "--io"))) {
+            if (strcmp(value, "mmap") == 0) {
+                options.io = IO_MMAP;
+            } else if (strcmp(value, "populate") == 0) {
+                options.io = IO_POPULATE;
+            } else if (strcmp(value, "pread") == 0) {
+                options.io = IO_PREAD;
+            } else if (strcmp(value, "direct") == 0) {
+                options.io = IO_DIRECT;
+            } else if (strcmp(value, "uring") == 0) {
+                options.io = IO_URING;
+            } else {
+                printf("Invalid value for --io: \"%s\"\n", value);
+                exit(1);
+            }
+        } else if ((value = option_value(argv[i], "--io-depth"))) {
+            options.io_depth = parse_u64_option("--io-depth", value, 1, 1024);
+            if (!is_power_of_two(options.io_depth)) {
+                printf("--io-depth must be a power of two\n");
+                exit(1);
+            }
+        } else if ((value = option_value(argv[i], "--io-threads"))) {
+            options.io_threads = parse_u64_option("--io-threads", value, 1, 64);
+        } else if ((value = option_value(argv[i], "--order"))) {
+            if (strcmp(value, "discovery") == 0) {
+                options.order = ORDER_DISCOVERY;
+            } else if (strcmp(value, "physical") == 0) {
+                options.order = ORDER_PHYSICAL;
+            } else if (strcmp(value, "inode") == 0) {
+                options.order = ORDER_INODE;
+            } else if (strcmp(value, "size") == 0) {
+                options.order = ORDER_SIZE;
+            } else {
+                printf("Invalid value for --order: \"%s\"\n", value);
+                exit(1);
+            }
+        } else if ((value = option_value(argv[i], "--index"))) {
+            options.index_path = value;
+        } else if (strcmp(argv[i], "--index-compact") == 0) {
+            options.index_compact = true;
+        } else if (strcmp(argv[i], "--no-cache-pollution") == 0) {
+            options.no_cache_pollution = true;
+        } else if (strcmp(argv[i], "--probe") == 0) {
+            options.probe = true;
+        } else if (strcmp(argv[i], "--adaptive") == 0) {
+            options.adaptive = true;
+        } else if (strcmp(argv[i], "--numa") == 0) {
+            options.numa = true;
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            options.watch = true;
+        } else if (strcmp(argv[i], "--no-dedup") == 0) {
+            options.dedup = false;
+        } else if (strcmp(argv[i], "--no-uring") == 0) {
+            options.use_uring = false;
+        } else if (strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            exit(0);
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            printf("Unknown option \"%s\"\n", argv[i]);
+            print_usage(argv[0]);
+            exit(1);
+        } else if (realpath(argv[i], absolute_path_buffer)) {
+            const str_t absolute_path = str_from_cstr(&arena_global, absolute_path_buffer);
+            paths[get_array_length(paths)] = absolute_path;
+            get_array_header(paths)->length++; // TODO: Add generic add/get functions to array.h
+        } else {
+            printf("Couldn't find real path for argument \"%s\"\n", argv[i]);
+        }
+    }
+    arena_clear(&arena_temp);
+
+    // Without a readable topology there's nothing to pin to
+    if (topo.core_count == 0) {
+        options.pinning = PINNING_OFF;
+    }
+    if (options.threads == 0) {
+        options.threads = default_thread_count();
+    }
+
+    // Probing reads a few headers per file, none of the sample data the I/O options are about
+    if (options.probe) {
+        if (options.index_path) {
+            printf("--probe can't be combined with --index\n");
+            exit(1);
+        }
+        options.io = IO_MMAP;
+        options.prefetch_budget = 0;
+    }
+
+    if (options.io == IO_URING && !readers_init()) {
+        printf("io_uring reads aren't available, running with --io=pread\n");
+        readers_delete();
+        options.io = IO_PREAD;
+    }
+
+    // Reading ahead into a page cache that won't be used would only cost memory
+    if (options.io == IO_DIRECT || options.io == IO_URING) {
+        options.prefetch_budget = 0;
+    }
+
+    if (options.numa) {
+        if (!numa_discover(&numa) || numa.node_count < 2) {
+            printf("--numa needs at least two NUMA nodes with usable CPUs, running without it\n");
+            options.numa = false;
+        } else if (numa.node_count > options.threads) {
+            numa.node_count = options.threads;
+        }
+    }
+
+    sched = sched_make(&arena_global, options.threads, options.numa ? numa.node_count : 1, FILE_QUEUE_CAPACITY);
+    if (!sched) {
+        printf("Failed to allocate the scheduler\n");
+        exit(1);
+    }
+
+    // Scratch pages are placed on the worker's node up front rather than wherever they're first touched
+    worker_scratch = arena_alloc(&arena_global, sizeof(worker_scratch_t) * options.threads);
+    for (u32 i = 0; i < options.threads; i++) {
+        worker_scratch[i] = (worker_scratch_t){ .arena = arena_make(WORKER_SCRATCH_SIZE) };
+        if (!arena_valid(&worker_scratch[i].arena)) {
+            printf("Failed to allocate worker scratch memory\n");
+            exit(1);
+        }
+        const bool reading = options.io == IO_PREAD || options.io == IO_DIRECT || options.io == IO_URING;
+        worker_scratch[i].buffer_arena = arena_make(PLANAR_BUFFER_SIZE + (reading ? IO_BLOCK_SIZE : 0));
+        if (!arena_valid(&worker_scratch[i].buffer_arena)) {
+            printf("Failed to allocate worker buffers\n");
+            exit(1);
+        }
+        if (reading) {
+            worker_scratch[i].read_buffer = arena_alloc_aligned(&worker_scratch[i].buffer_arena, IO_BLOCK_SIZE, IO_ALIGNMENT);
+        }
+        worker_scratch[i].planar = arena_alloc_aligned(&worker_scratch[i].buffer_arena, PLANAR_BUFFER_SIZE, CACHE_LINE_SIZE);
+        if (options.numa) {
+            numa_bind((void*)worker_scratch[i].arena.start, worker_scratch[i].arena.capacity, numa.nodes[sched->workers[i].group]);
+            numa_bind((void*)worker_scratch[i].buffer_arena.start, worker_scratch[i].buffer_arena.capacity, numa.nodes[sched->workers[i].group]);
+        }
+    }
+
+    // Each worker gets a CPU of its own, every core of its group's CPUs is used before any SMT sibling.
+    // With --pinning=off workers are only kept on their NUMA node, if any
+    cpu_set_t* worker_cpus = NULL;
+    cpu_set_t used_cpus;
+    CPU_ZERO(&used_cpus);
+    if (options.pinning != PINNING_OFF || options.numa) {
+        worker_cpus = arena_alloc(&arena_global, sizeof(cpu_set_t) * options.threads);
+        u32* order = arena_alloc(&arena_temp, sizeof(u32) * CPU_SETSIZE);
+        for (u32 i = 0; i < options.threads;) {
+            const u32 group = sched->workers[i].group;
+            const cpu_set_t* group_cpus = options.numa ? &numa.cpus[group] : &topo.allowed;
+            const u32 cpu_count = options.pinning != PINNING_OFF ? topo_order(&topo, group_cpus, order) : 0;
+            for (u32 k = 0; i < options.threads && sched->workers[i].group == group; i++, k++) {
+                if (cpu_count == 0) {
+                    worker_cpus[i] = *group_cpus;
+                } else {
+                    CPU_ZERO(&worker_cpus[i]);
+                    CPU_SET(order[k % cpu_count], &worker_cpus[i]);
+                }
+                CPU_OR(&used_cpus, &used_cpus, &worker_cpus[i]);
+            }
+        }
+        arena_clear(&arena_temp);
+    }
+
+    // Every other thread is started from here and inherits this, so traversal, prefetch, file list and watcher
+    // threads stay off the workers' cores and don't compete for their vector units
+    if (options.pinning == PINNING_CORES) {
+        cpu_set_t helper_cpus;
+        CPU_XOR(&helper_cpus, &topo.allowed, &used_cpus);
+        if (CPU_COUNT(&helper_cpus) > 0) {
+            pthread_setaffinity_np(pthread_self(), sizeof(helper_cpus), &helper_cpus);
+        }
+    }
+
+    fd_budget_init();
+
+    if (options.index_path) {
+        if (!file_index_open(&file_index, options.index_path, RESULT_VERSION, sizeof(file_result_t))) {
+            printf("Failed to open the index: %s\n", options.index_path);
+            exit(1);
+        }
+        if (options.index_compact) {
+            const u64 record_count = file_index.record_count;
+            if (!file_index_compact(&file_index, options.index_path)) {
+                printf("Failed to compact the index: %s\n", options.index_path);
+                exit(1);
+            }
+            printf("Compacted the index from %lu to %lu records\n", record_count, file_index.record_count);
+        }
+    } else if (options.index_compact) {
+        printf("--index-compact needs --index\n");
+        exit(1);
+    }
+
+    if (options.dedup && !inode_set_init(&inode_set)) {
+        printf("Failed to allocate the inode set\n");
+        exit(1);
+    }
+
+    walk_discoverers = arena_alloc(&arena_global, sizeof(discover_t) * options.walk_threads);
+    for (u32 i = 0; i < options.walk_threads; i++) {
+        if (!discover_init(&walk_discoverers[i], &arena_global)) {
+            printf("Failed to allocate discovery state\n");
+            exit(1);
+        }
+    }
+
+    if (options.size_window > 0 && options.order != ORDER_DISCOVERY) {
+        printf("--size-window only applies to --order=discovery\n");
+        exit(1);
+    }
+    if (options.watch && options.order != ORDER_DISCOVERY) {
+        printf("--watch can't be combined with --order\n");
+        exit(1);
+    }
+    if (options.watch && get_array_length(paths) == 0) {
+        printf("--watch needs at least one directory argument\n");
+        exit(1);
+    }
+
+    const bool walking = get_array_length(paths) > 0 || !options.files_from;
+    atomic_store(&active_sources, (walking ? 1 : 0) + (options.files_from ? 1 : 0) + (options.watch ? 1 : 0));
+
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    if (options.watch) {
+        // Results should show up as files land, even through a pipe
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    }
+
+    const u64 cached_before = options.no_cache_pollution ? page_cache_size() : 0;
+    const u64 analysis_start_ns = now_ns();
+
+    if (!output_start()) {
+        printf("Failed to start the output thread\n");
+        exit(1);
+    }
+    sched->idle = output_flush;
+
+    // Started after SIGINT/SIGTERM are blocked for the watcher, so workers inherit the mask
+    if (!sched_start(sched, worker_cpus)) {
+        printf("Failed to start analysis threads\n");
+        exit(1);
+    }
+    if (options.adaptive && !adapt_start()) {
+        printf("Failed to start the adaptive controller\n");
+        exit(1);
+    }
+    if (options.prefetch_budget > 0 && !prefetch_start()) {
+        printf("Failed to start the prefetch thread\n");
+        exit(1);
+    }
+    if (options.io == IO_URING && !readers_start()) {
+        printf("Failed to start the reader threads\n");
+        exit(1);
+    }
+
+    // Sources start last, anything they find goes straight into the stages above
+    watcher_t watcher = { 0 };
+    if (options.watch && !watcher_start(&watcher, paths, get_array_length(paths), &stop_signals)) {
+        printf("Failed to start watching\n");
+        exit(1);
+    }
+
+    file_list_t file_list = { 0 };
+    if (options.files_from && !file_list_start(&file_list, options.files_from)) {
+        printf("Failed to start reading the file list\n");
+        exit(1);
+    }
+
+    walk_t* walk = NULL;
+    if (walking) {
+        walk = walk_make(&arena_global, options.walk_threads, options.dir_buffer_size, on_files_found, on_walk_done, NULL);
+        for (u64 i = 0; i < get_array_length(paths); i++) {
+            walk_add_root(walk, &arena_global, paths[i]);
+        }
+        if (!walk_start(walk)) {
+            printf("Failed to start walk threads\n");
+            exit(1);
+        }
+    }
+
+    if (walk) {
+        walk_join(walk);
+    }
+    if (options.files_from) {
+        pthread_join(file_list.thread, NULL);
+        meta_delete(&file_list.discover.meta);
+    }
+    if (options.watch) {
+        pthread_join(watcher.thread, NULL);
+        meta_delete(&watcher.discover.meta);
+    }
+
+    if (options.order != ORDER_DISCOVERY) {
+        discover_t** discoverers = arena_alloc(&arena_global, sizeof(discover_t*) * (options.walk_threads + 1));
+        u64 discoverer_count = 0;
+        for (u32 i = 0; i < options.walk_threads; i++) {
+            discoverers[discoverer_count++] = &walk_discoverers[i];
+        }
+        if (options.files_from) {
+            discoverers[discoverer_count++] = &file_list.discover;
+        }
+
+        u64 job_count;
+        file_job_t** jobs = collect_sorted_jobs(&arena_global, discoverers, discoverer_count, &job_count);
+        for (u64 i = 0; i < job_count; i++) {
+            submit_job(jobs[i]);
+        }
+        close_submissions();
+    }
+
+    if (options.prefetch_budget > 0) {
+        pthread_join(prefetch.thread, NULL);
+    }
+    if (options.io == IO_URING) {
+        readers_join();
+    }
+    sched_join(sched);
+    output_finish();
+    if (options.io == IO_URING) {
+        readers_delete();
+    }
+    if (options.adaptive) {
+        adapt_stop();
+    }
+    sched_delete(sched);
+    const u64 analysis_end_ns = now_ns();
+
+    print_aliases();
+
+    if (walk) {
+        walk_delete(walk);
+    }
+    for (u32 i = 0; i < options.walk_threads; i++) {
+        meta_delete(&walk_discoverers[i].meta);
+    }
+
+    if (options.index_path) {
+        printf("Answered %lu files from the index\n", atomic_load(&index_hits));
+        file_index_close(&file_index);
+    }
+
+    // The tail is the stretch where workers run dry one after another while the last files finish
+    const u64 last_start = atomic_load(&last_start_ns);
+    printf("Analysis took %.3fs, the tail after the last file started %.3fs\n",
+           (analysis_end_ns - analysis_start_ns) / 1e9,
+           last_start > 0 ? (analysis_end_ns - last_start) / 1e9 : 0.0);
+
+    printf("Skipped %lu files without a WAV extension, %lu files without a RIFF/WAVE header\n",
+           atomic_load(&rejected_by_extension),
+           atomic_load(&rejected_by_header));
+
+    // System-wide, so other processes' reads and writes are in it too
+    if (options.no_cache_pollution) {
+        const u64 cached_after = page_cache_size();
+        printf("Page cache went from %.1f MB to %.1f MB (%+.1f MB) over the run\n",
+               (f64)cached_before / MB(1),
+               (f64)cached_after / MB(1),
+               ((f64)cached_after - (f64)cached_before) / MB(1));
+    }
 
-    // pthread_t* threads = array_from_size(pthread_t, &arena_global, NUM_THREADS);
-    //
-    // for (u64 i = 0; i < get_array_length(paths) && i < get_array_capacity(threads); i++) {
-    //     pthread_create(&threads[i], NULL, process_file, &paths[i]);
-    //     get_array_header(threads)->length++;
-    // }
-    //
-    // for (u64 i = 0; i < get_array_length(threads); i++) {
-    //     pthread_join(threads[i], NULL);
-    // }
+    printf("%u", atomic_load(&analyzed_count));
 }